@@ -1,13 +1,27 @@
 #include <iostream>
 #include <fstream>
 #include <boost/asio.hpp>
-#include <ctime>
+#include <cmath>
+#include <sstream>
+#include <iomanip>
 #include <future>
 #include <thread>
 #include <random>
 #include <vector>
-
-#define pixelRemedianMatrix remedianMatrix[electrode][pixel]
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/predef/other/endian.h>
 
 using namespace boost::asio;
 using boost::asio::ip::tcp;
@@ -34,500 +48,5243 @@ static const int PORT = 12345;
 static const string IP = "10.10.1.10";
 
 static const int PACKET_LENGTH = 1036; // Length of packet in bytes
+static const int SEGMENTS_PER_FRAME = 4;  // # of packets each line of the sensor is split into
+static const int SEGMENT_PIXELS = 512;  // # of pixels in each segment
+static const int HEADER_LENGTH = 636;  // Length of the header block start.py writes before the packets
 
 std::string dataPath = "data.bin";
 
+/* <!> Optional Parameters <!> */
+// Stores all "--name=value" arguments given to the program
+std::map<string, string> options;
+
 /* <!> Snippet and Electrode Data <!> */
+// Default detection parameters, which can be changed at startup with --config or --width, --snippet-depth, --depth, --layers and --threshold
 static const int WIDTH = 15;  // Radius around electrode centers
 static const int SNIPPET_DEPTH = 30;  // # of frames to be saved at a time
 static const int DEPTH = 10;  // Size of each pixel's remedian layer
 static const int LAYERS = 3;  // # of remedian layers
-static const int INTARR_SIZE = WIDTH * 2 + 1;  // Array size containing all pixels around electrode center
 static const int THRESHOLD = 1000;  // Threshold to detect a particle
+static const int MAX_WIDTH = 31;  // Largest radius the program accepts
+static const int MAX_SNIPPET_PIXELS = MAX_WIDTH * 2 + 1;  // Array size containing all pixels around electrode center at the largest radius
+static const int MAX_SNIPPET_DEPTH = 64;  // Largest # of frames which can be saved at a time
 static int numElectrodes;
-std::vector<int> electrodeLocations;
-// 3-dimensional array to store snippet data over time for each electrode
-std::vector<std::array<std::array<int16_t, INTARR_SIZE>, SNIPPET_DEPTH>> snippets;
+std::vector<int> electrodeLocations;  // Layout of every sensor without its own --sensor<N> layout
+
+// Detection parameters used by the program
+// How each remedian layer combines its values before passing them to the next layer
+enum Background {
+    MEAN_BACKGROUND,  // Average of each layer, as the program always did
+    MEDIAN_BACKGROUND  // Median of each layer, a true remedian
+};
+
+struct DetectionParameters {
+    int width = WIDTH;
+    int snippetDepth = SNIPPET_DEPTH;
+    int depth = DEPTH;
+    int layers = LAYERS;
+    int threshold = THRESHOLD;
+    Background background = MEAN_BACKGROUND;
 
-std::vector<std::future<void>> pending_futures;  // Stores all output from async functions
+    int snippetPixels() const {
+        return width * 2 + 1;
+    }
+};
+
+DetectionParameters parameters;
 
-std::vector<std::array<std::array<std::array<int16_t, DEPTH>, LAYERS>, INTARR_SIZE>> remedianMatrix;
-std::vector<std::array<int16_t, INTARR_SIZE>> remedians;
+// Pixels around an electrode center, of which only the first parameters.snippetPixels() are used
+typedef std::array<int16_t, MAX_SNIPPET_PIXELS> Snippet;
+typedef std::chrono::steady_clock::time_point Timestamp;  // When a packet arrived or a stage finished
 
-std::vector<int16_t> electrodeWeights;
+/* <!> Worker Pool Data <!> */
+static const int QUEUE_DEPTH = 1024;  // Max # of snippets waiting on each lane before the reader blocks
+static int numLanes;
 
 /*
 *  ==========================================================
-*  Inserting Function
+*  Option Function
 *  ==========================================================
-*  Inserts a value into the first spot of an array (removes the last element).
+*  Returns the value of an optional "--name=value" argument, or a default if it wasn't given.
 */
 
-void insertAtStart(std::array<int16_t, DEPTH>& arr, int16_t newVal) {
-    // Shifts all values one spot to the right
-    for (int i = DEPTH - 1; i > 0; i--) {
-        arr[i] = arr[i - 1];
+string getOption(const string& name, const string& defaultValue) {
+    auto option = options.find(name);
+    if (option == options.end()) {
+        return defaultValue;
+    }
+    return option->second;
+}
+
+// Reads "name=value" lines from a config file, without replacing options given on the command line
+// Blank lines and lines starting with # are skipped
+bool readConfig(const string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Could not open config file " << path << endl;
+        return false;
+    }
+    string line;
+    while (std::getline(file, line)) {
+        line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+        size_t equals = line.find('=');
+        if (line.empty() || line[0] == '#' || equals == string::npos) {
+            continue;
+        }
+        options.insert({ line.substr(0, equals), line.substr(equals + 1) });
     }
-    arr[0] = newVal;  // Inserts the new value at the beginning of the array
+    return true;
 }
 
 /*
 *  ==========================================================
-*  Averaging Function
+*  Published Values
 *  ==========================================================
-*  Calculates the average of an array.
+*  Lets any thread read a value which one thread keeps updating, without locks and without seeing a half-written value.
+*  The value has two copies: the writer fills the copy that isn't current, then makes it current by bumping a sequence number.
+*  A reader copies the current version and checks the sequence afterwards, retrying only if the writer started rewriting that copy,
+*  which takes a whole update, so the writer never waits and readers almost never retry.
 */
 
-template <typename T, size_t SIZE>
-T getAverage(std::array<T, SIZE> arr, int trueSize = SIZE) {
-    // Sums all values in the array
-    int sum = 0;
-    for (int index = 0; index < trueSize; index++) {
-        sum += arr[index];
+template <typename T>
+class Published {
+public:
+    Published() = default;
+
+    // Sets both copies, before any reader uses the value
+    void reset(const T& value) {
+        copies[0] = value;
+        copies[1] = value;
+    }
+
+    // Returns the copy to fill with the next version, which readers don't use until it is published
+    T& next() {
+        size_t current = sequence.load(std::memory_order_relaxed);
+        sequence.store(current + 1, std::memory_order_relaxed);  // Odd while the next version is written
+        std::atomic_thread_fence(std::memory_order_release);
+        return copies[(current / 2 + 1) % 2];
+    }
+
+    // Makes the copy returned by next() the current version
+    void publish() {
+        sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // The current version, only for the writer
+    const T& current() const {
+        return copies[sequence.load(std::memory_order_relaxed) / 2 % 2];
     }
-    T avg = sum / DEPTH;  // Gets average from the sum
-    return avg;
-}
 
-template <size_t WIDTH, size_t HEIGHT>
-int16_t average2D(std::array<std::array<int16_t, WIDTH>, HEIGHT> arr, int offset = 0) {
-    // Calculates the average for each row in the array
-    std::array<int16_t, HEIGHT> averages;
-    std::array<int16_t, WIDTH> currentRow;
-    int arrSize = HEIGHT - offset * 2;
-    for (int row = offset; row < HEIGHT - offset; row++) {
-        for (int column = 0; column < WIDTH; column++) {
-            currentRow[column] = arr[row][column];
+    // Copies the current version, from any thread
+    void read(T& value) const {
+        while (true) {
+            size_t before = sequence.load(std::memory_order_acquire);
+            value = copies[before / 2 % 2];
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // The copy is only rewritten once the writer starts the version after the next one
+            if (sequence.load(std::memory_order_relaxed) < before / 2 * 2 + 3) {
+                return;
+            }
         }
-        averages[row] = getAverage<int16_t, WIDTH>(currentRow);
     }
 
-    return getAverage<int16_t, HEIGHT>(averages, arrSize);  // Total average of the array
-}
+private:
+    std::array<T, 2> copies = {};
+    std::atomic<size_t> sequence{ 0 };  // Twice the # of versions published, plus one while a version is written
+};
 
 /*
 *  ==========================================================
-*  Two's Complement Function
+*  Background State
 *  ==========================================================
-*  Takes the two's complement of the concatenation of two 8-bit numbers.
+*  Everything an electrode has learned about its background, written as one block of bytes for --checkpoint.
+*  Every detector writes the same layout for the same parameters, so a state saved by a compiled kernel loads into the generic one.
+*  The block holds the published remedian, then each remedian layer (head, fill, values in slot order and sums),
+*  then the rows and prefix sums of the snippet history, newest first.
 */
-int16_t twos(int msb, int lsb) {
-    int16_t complement = msb << 8 | lsb; // Combines all four bytes into a 16-bit number
-    return complement;
+
+// Writes fields one after another into a block of bytes
+class StateWriter {
+public:
+    explicit StateWriter(uint8_t* bytes) : position(bytes) {}
+
+    template <typename T>
+    void write(const T* values, size_t count) {
+        std::memcpy(position, values, count * sizeof(T));
+        position += count * sizeof(T);
+    }
+
+    template <typename T>
+    void write(T value) {
+        write(&value, 1);
+    }
+
+private:
+    uint8_t* position;
+};
+
+// Reads fields in the order StateWriter wrote them
+class StateReader {
+public:
+    explicit StateReader(const uint8_t* bytes) : position(bytes) {}
+
+    template <typename T>
+    void read(T* values, size_t count) {
+        std::memcpy(values, position, count * sizeof(T));
+        position += count * sizeof(T);
+    }
+
+    template <typename T>
+    T read() {
+        T value;
+        read(&value, 1);
+        return value;
+    }
+
+private:
+    const uint8_t* position;
+};
+
+// Size of one electrode's state with the given parameters
+size_t backgroundStateBytes(const DetectionParameters& parameters) {
+    size_t pixels = parameters.snippetPixels();
+    size_t layerBytes = 2 * sizeof(uint32_t) + parameters.depth * pixels * sizeof(int16_t) + pixels * sizeof(int32_t);
+    return pixels * sizeof(int16_t) + parameters.layers * layerBytes + parameters.snippetDepth * pixels * sizeof(int16_t)
+        + (parameters.snippetDepth + 1) * sizeof(int64_t);
 }
 
 /*
 *  ==========================================================
-*  Particle Write Function
+*  Snippet History
 *  ==========================================================
-*  Writes a detected particle into a file.
-*  Useful for graphing particles as they're received.
+*  Stores the last HISTORY background subtracted snippets of an electrode in a ring buffer.
+*  The average of each row is kept with a running prefix sum, so the 2D average of the full window or
+*  of any window shrunk by an offset on both ends is read without summing the snippets again.
+*  Like the original average2D, each row sum and the total are divided by DIVISOR (the remedian DEPTH) and truncated.
+*  Other threads copy the rows with read(), which retries if a snippet was pushed while it was copying.
 */
 
-void writeParticlesCSV(int chosenElectrode, int frame, int weight, int similar) {
-    std::ofstream file("particles.csv", std::ios::out | std::ios::app);
-    file << chosenElectrode << "," << frame << "," << weight << "," << similar << "\n";
-    for (std::array<std::array<int16_t, INTARR_SIZE>, SNIPPET_DEPTH> snippet : snippets) {
-        for (std::array<int16_t, INTARR_SIZE> column : snippet) {
-            for (int16_t pixel : column) {
-                file << pixel << ",";
+template <size_t PIXELS, size_t HISTORY, int DIVISOR>
+class SnippetHistory {
+public:
+    // Puts a snippet at the front of the history, erasing the oldest snippet
+    void push(const std::array<int16_t, PIXELS>& snippet) {
+        int sum = 0;
+        for (size_t pixel = 0; pixel < PIXELS; pixel++) {
+            sum += snippet[pixel];
+        }
+        int16_t rowAverage = sum / DIVISOR;
+
+        size_t version = sequence.load(std::memory_order_relaxed);
+        sequence.store(version + 1, std::memory_order_relaxed);  // Odd while the row is written
+        std::atomic_thread_fence(std::memory_order_release);
+        rows[count % HISTORY] = snippet;
+        prefix[(count + 1) % (HISTORY + 1)] = prefix[count % (HISTORY + 1)] + rowAverage;
+        count++;
+        sequence.store(version + 2, std::memory_order_release);
+    }
+
+    // Takes the 2D average of the history, skipping offset snippets at both the newest and oldest ends
+    int16_t weight(int offset = 0) const {
+        if (offset * 2 >= (int)HISTORY) {
+            return 0;
+        }
+        long long newest = prefix[(count - offset) % (HISTORY + 1)];
+        long long oldest = prefix[(count - HISTORY + offset) % (HISTORY + 1)];
+        int16_t avg = (int)(newest - oldest) / DIVISOR;
+        return avg;
+    }
+
+    // Returns a snippet by its age, where age 0 is the newest snippet
+    const std::array<int16_t, PIXELS>& row(size_t age) const {
+        return rows[(count - 1 - age) % HISTORY];
+    }
+
+    // Copies every snippet, newest first, from any thread
+    void read(int16_t* copy) const {
+        while (true) {
+            size_t before = sequence.load(std::memory_order_acquire);
+            if (before % 2 == 0) {
+                for (size_t age = 0; age < HISTORY; age++) {
+                    std::copy_n(row(age).data(), PIXELS, copy + age * PIXELS);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) == before) {
+                    return;
+                }
             }
+            std::this_thread::yield();
         }
-        file << "\n";
     }
-}
 
-/*
-*  ==========================================================
-*  CSV Snippet Write Function
-*  ==========================================================
-*  Writes a snippet to its associated .csv file.
-*  Useful for graphing each snippet individually.
-*/
-void writeSnippetCSV(std::array<int16_t, INTARR_SIZE> data, int frame, int segment, int sensor, int led_config, int electrode) {
-    // Opens the corresponding snippet output file in append mode
-    std::ofstream file("out" + std::to_string(electrode) + ".csv", std::ios::out | std::ios::app);
-    file << frame << "," << segment << "," << sensor << "," << led_config;  // Writes the initial packet information
-    // Writes all pixel values minus their respective remedians
-    for (int pixel = 0; pixel < INTARR_SIZE; pixel++) {
-        file << "," << data[pixel] - remedians[electrode][pixel];
+    // Writes the rows and prefix sums newest first, only from the thread pushing snippets
+    void save(StateWriter& writer) const {
+        for (size_t age = 0; age < HISTORY; age++) {
+            writer.write(row(age).data(), PIXELS);
+        }
+        for (size_t age = 0; age <= HISTORY; age++) {
+            writer.write<int64_t>(prefix[(count - age) % (HISTORY + 1)]);
+        }
     }
-    for (int pixel = 0; pixel < INTARR_SIZE; pixel++) {
-        file << "," << data[pixel];
+
+    // Restores the rows and prefix sums written by save, before any snippet is pushed
+    void load(StateReader& reader) {
+        count = HISTORY;
+        for (size_t age = 0; age < HISTORY; age++) {
+            reader.read(rows[(count - 1 - age) % HISTORY].data(), PIXELS);
+        }
+        for (size_t age = 0; age <= HISTORY; age++) {
+            prefix[(count - age) % (HISTORY + 1)] = reader.read<int64_t>();
+        }
     }
-    file << "\n";  // Writes a newline character to separate packets
-    file.close();
-}
+
+private:
+    std::array<std::array<int16_t, PIXELS>, HISTORY> rows = {};
+    std::array<long long, HISTORY + 1> prefix = {};  // Running sum of every row average pushed so far
+    size_t count = HISTORY;  // # of snippets pushed, starting as if the history was filled with empty snippets
+    std::atomic<size_t> sequence{ 0 };  // Twice the # of snippets pushed, plus one while one is being pushed
+};
 
 /*
 *  ==========================================================
-*  CSV Remedian Write Function
+*  Detector Interface
 *  ==========================================================
-*  Writes all pixel remedians for a snippet into its corresponding .csv file.
-*  Useful for tracking remedian values in case of error.
+*  Holds the remedians and snippet history of every electrode.
+*  Each implementation is compiled for one set of detection parameters (see Detection Kernels), and is chosen at startup.
+*  An electrode is only ever updated by one thread at a time, and only readRemedian and readHistory may be called from other threads.
 */
 
-void writeRemediansCSV(int electrode) {
-    std::ofstream file("remedians" + std::to_string(electrode) + ".csv", std::ios::out | std::ios::app);  // Opens the remedian output file in append mode
-    // Loops through all remedians for the snippet and writes them to the file
-    for (int16_t remedian : remedians[electrode]) {
-        file << remedian << ",";
-    }
-    file << "\n";
-    file.close();
-}
+class Detector {
+public:
+    virtual ~Detector() {}
+
+    // Updates the remedian of every pixel in an electrode's snippet
+    virtual void updateRemedian(int electrode, const int16_t* snippet) = 0;
+
+    // Puts the background subtracted snippet in the electrode's history, returning the 2D average of the history
+    virtual int16_t detect(int electrode, const int16_t* snippet) = 0;
+
+    // Takes the 2D average of an electrode's history, skipping offset snippets at both the newest and oldest ends
+    virtual int16_t weight(int electrode, int offset) const = 0;
+
+    // Returns the remedian the electrode's next snippet is subtracted by, only for the thread updating the electrode
+    virtual const int16_t* remedian(int electrode) const = 0;
+
+    // Returns a background subtracted snippet of an electrode by its age, where age 0 is the newest snippet
+    virtual const int16_t* row(int electrode, int age) const = 0;
+
+    // Copies the last published remedian of an electrode, from any thread
+    virtual void readRemedian(int electrode, int16_t* remedian) const = 0;
+
+    // Copies every background subtracted snippet of an electrode, newest first, from any thread
+    virtual void readHistory(int electrode, int16_t* rows) const = 0;
+
+    // Writes the electrode's background state (see Background State), only from the thread updating the electrode
+    virtual void saveState(int electrode, uint8_t* bytes) const = 0;
+
+    // Restores an electrode from a state written with the same parameters, before any of its snippets are processed
+    virtual void loadState(int electrode, const uint8_t* bytes) = 0;
+
+    // Whether the detector was compiled for the parameters, rather than the generic fallback
+    virtual bool specialized() const = 0;
+};
 
 /*
 *  ==========================================================
-*  Location Write Function
+*  Sensor State
 *  ==========================================================
-*  Writes all particle locations into a .csv file.
-*  Useful for verifying particle locations using post-processed data.
+*  Everything the detection keeps for one sensor of one connection, so several sensors and connections can be processed at once.
+*  Each (connection, sensor) pair is a stream with its own electrode layout and detector, numbered in the order they are first seen.
+*  The output of every stream is logged with its number.
+*  The weights of each frame are collected in a slot, so the particle decision only sees weights of that frame, whichever lanes calculated them.
 */
 
-void writeLocation(int frame, int electrode) {
-    std::ofstream file("locations.csv", std::ios::out | std::ios::app);
-    file << frame << "," << electrodeLocations[electrode] << "," << electrodeWeights[electrode] << "\n";
-    file.close();
-}
+static const int FRAME_SLOTS = 256;  // # of frames of a stream which can wait on their decision at once
+static const int LINE_PIXELS = SEGMENTS_PER_FRAME * SEGMENT_PIXELS + 2 * MAX_WIDTH;  // A whole line of the sensor, with zeros past both edges
+
+// The part of one electrode's snippet contained in a segment
+struct SnippetRoute {
+    int electrode;
+    int firstPixel;  // Pixel in the segment where this part starts
+    int count;  // # of pixels in this part
+    bool completes;  // Whether this is the last part of the snippet
+};
+
+// A snippet being put together from the segments of a frame, whose pixels are in the frame's line
+struct PartialSnippet {
+    int frame = -1;
+    int parts = 0;  // # of parts received for the frame
+    int totalParts = 0;  // # of parts needed to complete the snippet
+};
+
+// The weights of every electrode in one frame, filled in by the lanes as they finish its snippets
+// The reader holds a reference until it read the frame's last segment, and each snippet sent to a lane holds one until it is weighed
+// Whoever releases the last reference makes the decision, unless the frame's deadline passed and the watchdog already made it
+struct FrameSlot {
+    std::atomic<bool> free{ true };  // Set once the decision was made and every reference released, so the reader can reuse the slot
+    std::atomic<int> references{ 0 };
+    std::atomic<bool> decided{ false };  // Claimed by the thread making the decision
+    std::atomic<Timestamp::rep> arrival{ 0 };  // When the latest packet of the frame arrived
+    int frame = -1;
+    Timestamp opened;  // When the first packet of the frame arrived, which the deadline counts from
+    std::unique_ptr<std::atomic<bool>[]> weighed;  // Whether each electrode's weights were written
+    std::unique_ptr<int16_t[]> weights;  // weightOffsets weights for each electrode, in electrode order
+};
+
+// A particle followed across the electrodes by the tracker (--track)
+// It arrives at an electrode in the first frame that electrode's weight passes the threshold
+struct Track {
+    int electrode = -1;  // Electrode it last arrived at
+    int frame = 0;  // Frame it arrived there
+    int arrivals = 0;  // # of electrodes it arrived at
+    double position = 0;  // Filtered location in pixels, at that frame
+    double velocity = 0;  // Filtered pixels per frame, known once it arrived at a second electrode
+    int predicted = -1;  // Electrode it is expected to arrive at next, or -1
+    double predictedFrame = 0;  // Frame it is expected to arrive there
+    bool armed = false;  // Whether the command for the predicted electrode was sent
+    int armedFrame = 0;
+    Timestamp armedTime;
+};
+
+struct SensorState {
+    int stream = 0;
+    int sensor = 0;
+    int numElectrodes = 0;
+    std::vector<int> electrodeLocations;
+    std::unique_ptr<Detector> detector;  // Remedians and snippet history of every electrode
+    int weightOffsets = 1;  // # of weights kept for each electrode, the full window followed by each narrower window
+    std::vector<FrameSlot> frames;  // Indexed by the frame number modulo FRAME_SLOTS
+    std::atomic<long long> lateFrames{ 0 };  // # of frames decided at the deadline, without every electrode
+    std::unique_ptr<Published<std::vector<uint8_t>>[]> checkpoints;  // Latest saved background state of each electrode, with --checkpoint
+
+    // Only used by the thread deciding a frame while it holds trackMutex, with --track
+    std::mutex trackMutex;
+    std::vector<Track> tracks;
+    std::vector<uint8_t> aboveThreshold;  // Whether each electrode's weight passed the threshold in the last tracked frame
+    std::vector<uint8_t> covered;  // Whether each electrode's detections are covered by a command sent ahead, until its weight drops
+    int trackedFrame = -1;  // Last frame given to the tracker
+
+    // Only used by the thread reading the connection
+    std::array<std::vector<SnippetRoute>, SEGMENTS_PER_FRAME> routes;  // Routes of each segment, in electrode order
+    std::vector<PartialSnippet> partialSnippets;
+    std::array<int16_t, LINE_PIXELS> line = {};  // Decoded pixels of the latest segments, where pixel p is at MAX_WIDTH + p
+    int lastSegment = -1;  // Last segment with part of a snippet, after which a frame gets no more weights
+    int frame = -1;  // Frame of the last packet read
+    bool frameOpen = false;  // Whether the reader still holds its reference to that frame's slot
+    long long incompleteSnippets = 0;  // # of snippets dropped because one of their segments was missing
+    long long slotWaits = 0;  // # of times the reader waited for the lanes to free a frame slot
+};
 
 /*
 *  ==========================================================
-*  Segment Write Function
+*  Two's Complement Function
 *  ==========================================================
-*  Writes all segments into a .csv file.
-*  Useful for plotting the full raw data.
+*  Takes the two's complement of the concatenation of two 8-bit numbers.
 */
-
-void writeSegment(int frame, int segment, std::array<uint8_t, PACKET_LENGTH> packet) {
-    std::ofstream file("fullData.csv", std::ios::out | std::ios::app);
-    file << frame << "," << segment << "\n";
-    for (int i = 0; i < PACKET_LENGTH; i += 2) {
-        file << twos(packet[i + 1], packet[i]) << ",";
-    }
-    file << "\n";
-    file.close();
+int16_t twos(int msb, int lsb) {
+    int16_t complement = msb << 8 | lsb; // Combines all four bytes into a 16-bit number
+    return complement;
 }
 
 /*
 *  ==========================================================
-*  Binary Write Function
+*  Segment Decode
 *  ==========================================================
-*  Writes all binary data to a file given by the file path when calling the program (default "data.bin")
+*  Reads the header of a packet and decodes its pixels, giving the same values as twos() on each pair of bytes.
+*  The pixels are little-endian, so on little-endian machines decoding a range of pixels is a single copy,
+*  which the reader does once for the whole segment instead of once for each electrode's snippet.
 */
 
-void writeToFile(std::array<uint8_t, PACKET_LENGTH> packet) {
-    std::ofstream file(dataPath, std::ios::out | std::ios::binary | std::ios::app);  // Opens the file in append mode
-    // Loops through each byte in the packet and writes it to the file
-    for (int i = 0; i < packet.size(); i++) {
-        file.write((char*)&packet[i], 1);
+// The fields at the start of every packet, which overwrite its first pixels
+struct SegmentHeader {
+    int frame;
+    int segment;
+    int sensor;
+    int ledConfig;
+};
+
+SegmentHeader readHeader(const uint8_t* packet) {
+    return { packet[0] << 24 | packet[1] << 16 | packet[2] << 8 | packet[3], packet[4], packet[5], packet[6] << 8 | packet[7] };
+}
+
+// Decodes count pixels of a packet, starting at pixel first
+void decodePixels(const uint8_t* packet, int first, int count, int16_t* pixels) {
+#if BOOST_ENDIAN_LITTLE_BYTE
+    std::memcpy(pixels, packet + first * 2, count * sizeof(int16_t));
+#else
+    for (int pixel = 0; pixel < count; pixel++) {
+        pixels[pixel] = twos(packet[(first + pixel) * 2 + 1], packet[(first + pixel) * 2]);
     }
-    file.close();
+#endif
 }
 
 /*
 *  ==========================================================
-*  Remedian Calculation Function
+*  Latency Statistics
 *  ==========================================================
-*  Calculates the remedian for a pixel of a snippet.
+*  Measures the wall-clock time from a packet's arrival to the end of each processing stage.
+*  Every thread records into its own log-linear histograms, so recording is a few relaxed stores with no locks or shared cache lines.
+*  Each bucket covers 1/32 of a power of two, so a percentile is within about 3% of the true value.
+*  The histograms of all threads are merged when a report is requested, either by sending SIGUSR1 to the program,
+*  by connecting to the --stats-socket path (e.g. "socat - UNIX-CONNECT:<path>"), or at shutdown.
 */
 
-void calculateRemedian(int electrode, int pixel, int16_t val) {
-    insertAtStart(pixelRemedianMatrix[0], val);  // Inserts the new pixel value in the first array in the remedian matrix
+enum Stage {
+    DECODE_STAGE,  // Arrival to every snippet of the packet being queued on a lane
+    REMEDIAN_STAGE,  // Arrival to a snippet's remedian being updated
+    DETECTION_STAGE,  // Arrival to a snippet's electrode weight being calculated
+    DECISION_STAGE,  // Arrival to the particle decision of the frame
+    ACTUATOR_STAGE,  // Particle decision to the electrode being written to the Arduino
+    TOTAL_STAGE,  // Arrival to the electrode being written to the Arduino
+    NUM_STAGES
+};
 
-    // If the first array is full, gets the average of that array and inserts that into the next array
-    if (pixelRemedianMatrix[0][DEPTH - 1] != 0) {
-        int16_t prevLayerAvg = getAverage<int16_t, DEPTH>(pixelRemedianMatrix[0]);
+static const char* STAGE_NAMES[NUM_STAGES] = { "decode", "remedian", "detection", "decision", "actuator write", "arrival to actuator" };
 
-        // Inserts the previous layer's average into the next layer, repeating while each successive array is full
-        bool loop = true;
-        int layer = 1;
-        while (loop && layer < LAYERS - 1) {
-            insertAtStart(pixelRemedianMatrix[layer], prevLayerAvg);  // Inserts the previous array average into the current layer
+enum Counter { PACKET_COUNTER, SNIPPET_COUNTER, DECISION_COUNTER, PARTICLE_COUNTER, NUM_COUNTERS };
 
-            // If the current layer isn't full, break the loop
-            if (pixelRemedianMatrix[layer][DEPTH - 1] == 0) {
-                loop = false;
-            }
-            // Otherwise get the average of the current layer and move to the next layer
-            else {
-                prevLayerAvg = getAverage<int16_t, DEPTH>(pixelRemedianMatrix[layer]);
-                layer++;
-            }
+static const char* COUNTER_NAMES[NUM_COUNTERS] = { "packets", "snippets", "decisions", "particles" };
+
+// Histogram of nanosecond latencies with a single writing thread
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = SUB_BUCKETS * (64 - SUB_BITS + 1);
+
+    void record(uint64_t nanoseconds) {
+        std::atomic<uint64_t>& bucket = counts[bucketOf(nanoseconds)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (nanoseconds > max.load(std::memory_order_relaxed)) {
+            max.store(nanoseconds, std::memory_order_relaxed);
         }
+    }
 
-        // Inserts the second-last layer's average into the deepest layer (if it was full)
-        if (layer == LAYERS - 1) {
-            insertAtStart(pixelRemedianMatrix[LAYERS - 1], prevLayerAvg);
+    // Values below SUB_BUCKETS get a bucket each, larger values are split into SUB_BUCKETS buckets per power of two
+    static int bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return (int)value;
         }
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - SUB_BITS;
+        return SUB_BUCKETS + shift * SUB_BUCKETS + (int)((value >> shift) - SUB_BUCKETS);
+    }
 
-        // Clears all full layers
-        int index = 0;
-        while (index < layer - 1) {
-            for (int i = 0; i < DEPTH; i++) {
-                pixelRemedianMatrix[index][i] = 0;
-            }
-            index++;
+    // Largest value which falls in a bucket
+    static uint64_t bucketLimit(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
         }
+        int shift = bucket / SUB_BUCKETS - 1;
+        uint64_t mantissa = SUB_BUCKETS + bucket % SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
     }
 
-    // Sets the new remedian for that pixel to the average of the deepest layer
-    remedians[electrode][pixel] = getAverage<int16_t, DEPTH>(pixelRemedianMatrix[LAYERS - 1]);
-}
+    std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+    std::atomic<uint64_t> max{ 0 };
+};
 
-/*
-*  ==========================================================
-*  Particle Weight Calculation Function
-*  ==========================================================
-*  Calculates the 2D average of a snippet image and determines if a particle is detected.
-*/
+// Percentiles of a stage in nanoseconds
+struct StageSummary {
+    uint64_t count = 0;
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+    uint64_t max = 0;
+};
 
-void detectParticle(std::array<int16_t, INTARR_SIZE> snippet, int frame, int segment, int electrode, clock_t clock) {
-    // Subtracts the remedian value for each pixel in the snippet
-    std::array<int16_t, INTARR_SIZE> subbedSnippet;
-    for (int pixel = 0; pixel < INTARR_SIZE; pixel++) {
-        subbedSnippet[pixel] = abs(snippet[pixel] - remedians[electrode][pixel]);
-    }
+struct ThreadStatistics {
+    std::array<LatencyHistogram, NUM_STAGES> stages;
+    std::array<std::atomic<uint64_t>, NUM_COUNTERS> counters{};
+};
 
-    // Puts the snippet at the front of its associated array, erasing the oldest snippet
-    for (int i = SNIPPET_DEPTH - 1; i > 0; i--) {
-        snippets[electrode][i] = snippets[electrode][i - 1];
+class Statistics {
+public:
+    // Records the time from a timestamp to now for a stage
+    void record(Stage stage, Timestamp since) {
+        record(stage, since, std::chrono::steady_clock::now());
     }
-    snippets[electrode][0] = subbedSnippet;
 
-    // Takes a 2D average of the backgruond subtracted snippet matrix
-    int16_t electrodeWeight = average2D<INTARR_SIZE, SNIPPET_DEPTH>(snippets[electrode]);
-    electrodeWeights[electrode] = electrodeWeight;
+    void record(Stage stage, Timestamp since, Timestamp now) {
+        long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count();
+        local().stages[stage].record(nanoseconds > 0 ? nanoseconds : 0);
+    }
 
-    // If all electrodes had their average calculated
-    if (electrode == numElectrodes - 1) {
+    void count(Counter counter, uint64_t amount = 1) {
+        std::atomic<uint64_t>& value = local().counters[counter];
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
 
-        // Determines which averages are above the threshold
-        std::vector<int> aboveThreshold;
-        for (int index = 0; index < numElectrodes; index++) {
-            if (abs(electrodeWeights[index]) >= THRESHOLD) {
-                aboveThreshold.push_back(index);
+    // Merges every thread's histogram of a stage into its percentiles in nanoseconds
+    StageSummary summarize(Stage stage) {
+        std::vector<uint64_t> merged(LatencyHistogram::BUCKETS, 0);
+        StageSummary summary;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const std::unique_ptr<ThreadStatistics>& thread : threads) {
+                for (int bucket = 0; bucket < LatencyHistogram::BUCKETS; bucket++) {
+                    merged[bucket] += thread->stages[stage].counts[bucket].load(std::memory_order_relaxed);
+                }
+                summary.max = std::max(summary.max, thread->stages[stage].max.load(std::memory_order_relaxed));
             }
         }
+        for (uint64_t count : merged) {
+            summary.count += count;
+        }
+        summary.p50 = percentile(merged, summary.count, 0.5, summary.max);
+        summary.p99 = percentile(merged, summary.count, 0.99, summary.max);
+        summary.p999 = percentile(merged, summary.count, 0.999, summary.max);
+        return summary;
+    }
 
-        // If there is an average above the threshold
-        if (aboveThreshold.size() >= 1) {
-            // If only one average is above the threshold
-            if (aboveThreshold.size() == 1) {
-                if(writeParticles) writeParticlesCSV(aboveThreshold[0], frame, electrodeWeights[aboveThreshold[0]], 0);
-            }
-            // If more than one average is above the threshold
-            else if (aboveThreshold.size() > 1) {
+    uint64_t total(Counter counter) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t sum = 0;
+        for (const std::unique_ptr<ThreadStatistics>& thread : threads) {
+            sum += thread->counters[counter].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
 
-                // While there is still more than one average above the threshold
-                int offset = 1;
-                while (aboveThreshold.size() > 1 && offset < WIDTH - 1) {
-                    // Take the 2D average with a smaller window from the snippet matrix
-                    std::vector<int> newAboveThreshold;
-                    for (int electrode : aboveThreshold) {
-                        int16_t centeredWeight = average2D<INTARR_SIZE, SNIPPET_DEPTH>(snippets[electrode], offset);
-                        // Save the electrode if its average is still above the threshold
-                        if (abs(centeredWeight) >= THRESHOLD) {
-                            newAboveThreshold.push_back(electrode);
-                        }
-                    }
-                    aboveThreshold = newAboveThreshold;
-                    offset++;
+    // Clears every histogram and counter, only safe while no thread is recording
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::unique_ptr<ThreadStatistics>& thread : threads) {
+            for (LatencyHistogram& histogram : thread->stages) {
+                for (std::atomic<uint64_t>& count : histogram.counts) {
+                    count.store(0, std::memory_order_relaxed);
                 }
-                // If there is still more than one average
-                if (aboveThreshold.size() > 1 || aboveThreshold.size() == 0) {
-                    int16_t maxWeight = 0;
-                    int maxWeightIndex;
-                    // Finds the electrode with the highest average
-                    for (int index = 0; index < numElectrodes; index++) {
-                        if (abs(electrodeWeights[index]) > abs(maxWeight)) {
-                            maxWeight = electrodeWeights[index];
-                            maxWeightIndex = index;
-                        }
-                    }
-                    aboveThreshold = { maxWeightIndex };
-                }
-                if(writeParticles) writeParticlesCSV(aboveThreshold[0], frame, electrodeWeights[aboveThreshold[0]], 1);
-                
+                histogram.max.store(0, std::memory_order_relaxed);
             }
-            writeLocation(frame, aboveThreshold[0]);  // Saves the particle location
+            for (std::atomic<uint64_t>& counter : thread->counters) {
+                counter.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
 
-            // Sends the electrode that contains the particle to the Arduino
-            boost::asio::io_context io_service;
-            serial_port port(io_service);
-            port.open("COM6");
-            unsigned char szBuff[1] = { aboveThreshold[0] };
-            port.write_some(buffer(szBuff, 1));
+    // Formats every stage's percentiles in microseconds and the counters as a table
+    string report() {
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(1);
+        text << std::left << std::setw(22) << "Latency (us)" << std::right << std::setw(12) << "count" << std::setw(10) << "p50"
+            << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(10) << "max" << "\n";
+        for (int stage = 0; stage < NUM_STAGES; stage++) {
+            StageSummary summary = summarize((Stage)stage);
+            text << std::left << std::setw(22) << STAGE_NAMES[stage] << std::right << std::setw(12) << summary.count
+                << std::setw(10) << summary.p50 / 1000.0 << std::setw(10) << summary.p99 / 1000.0
+                << std::setw(10) << summary.p999 / 1000.0 << std::setw(10) << summary.max / 1000.0 << "\n";
+        }
+        for (int counter = 0; counter < NUM_COUNTERS; counter++) {
+            text << (counter == 0 ? "Counters: " : ", ") << COUNTER_NAMES[counter] << " " << total((Counter)counter);
         }
+        text << "\n";
+        return text.str();
     }
-    double duration = (std::clock() - clock) / (double)CLOCKS_PER_SEC;
-    cout << "Runtime: " << duration * 1000 << "ms" << endl;
-}
 
-/*
-*  ==========================================================
-*  Remedian Function
-*  ==========================================================
-*  Calls the remedian calculation function for each pixel in the snippet.
-*/
+    // Starts the thread which prints a report on SIGUSR1 and serves reports on a local socket
+    void start(const string& socketPath) {
+#ifdef SIGUSR1
+        signals.add(SIGUSR1);
+        waitSignal();
+#endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        if (!socketPath.empty()) {
+            path = socketPath;
+            std::remove(path.c_str());
+            boost::system::error_code error;
+            acceptor.open(local::stream_protocol(), error);
+            if (!error) acceptor.bind(local::stream_protocol::endpoint(path), error);
+            if (!error) acceptor.listen(socket_base::max_listen_connections, error);
+            if (error) {
+                std::cerr << "Statistics: can't listen on " << path << ": " << error.message() << endl;
+                acceptor.close();
+                path.clear();
+            }
+            else {
+                waitConnection();
+            }
+        }
+#else
+        if (!socketPath.empty()) {
+            std::cerr << "Statistics: local sockets aren't supported on this platform" << endl;
+        }
+#endif
+        server = std::thread([this] { io.run(); });
+    }
 
-void findRemedian(std::array<int16_t, INTARR_SIZE> snippet, int electrode) {
-    // Finds the remedian for each pixel in the snippet
-    for (int pixel = 0; pixel < INTARR_SIZE; pixel++) {
-        calculateRemedian(electrode, pixel, snippet[pixel]);
+    void stop() {
+        io.stop();
+        if (server.joinable()) {
+            server.join();
+        }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        if (!path.empty()) {
+            acceptor.close();
+            std::remove(path.c_str());
+        }
+#endif
     }
 
-    if (writeRemedians) {
-        writeRemediansCSV(electrode);
+private:
+    // Finds the smallest bucket containing the quantile, capped at the largest recorded value
+    static uint64_t percentile(const std::vector<uint64_t>& counts, uint64_t total, double quantile, uint64_t max) {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t target = (uint64_t)std::ceil(quantile * total);
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < LatencyHistogram::BUCKETS; bucket++) {
+            seen += counts[bucket];
+            if (seen >= target) {
+                return std::min(LatencyHistogram::bucketLimit(bucket), max);
+            }
+        }
+        return max;
     }
-}
 
-/*
-*  ==========================================================
-*  Ethernet Read Function
-*  ==========================================================
-*  Reads data over ethernet, given a packet length.
-*  The data is stored into a uint8_t array, the standard type for unsigned byte data.
-*/
+    // Registers a set of histograms for the calling thread the first time it records
+    ThreadStatistics& local() {
+        thread_local ThreadStatistics* statistics = nullptr;
+        if (!statistics) {
+            std::unique_ptr<ThreadStatistics> created(new ThreadStatistics());
+            statistics = created.get();
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(std::move(created));
+        }
+        return *statistics;
+    }
 
-std::array<uint8_t, PACKET_LENGTH> read_(tcp::socket& socket) {
-    std::array<uint8_t, PACKET_LENGTH> buf;  // uint8_t buffer to store the data
-    boost::asio::read(socket, boost::asio::buffer(buf), boost::asio::transfer_exactly(PACKET_LENGTH));  // Reads a packet of a certain length to the buffer
-    return buf;  // Returns the buffer
-}
+    void waitSignal() {
+        signals.async_wait([this](const boost::system::error_code& error, int) {
+            if (!error) {
+                std::cerr << report();
+                waitSignal();
+            }
+        });
+    }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    void waitConnection() {
+        acceptor.async_accept([this](const boost::system::error_code& error, local::stream_protocol::socket client) {
+            if (!error) {
+                boost::system::error_code ignored;
+                boost::asio::write(client, buffer(report()), ignored);
+            }
+            if (acceptor.is_open()) {
+                waitConnection();
+            }
+        });
+    }
+#endif
+
+    std::vector<std::unique_ptr<ThreadStatistics>> threads;  // Never shrinks, so a thread's statistics outlive it
+    std::mutex mutex;
+    boost::asio::io_context io;
+    boost::asio::signal_set signals{ io };
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    local::stream_protocol::acceptor acceptor{ io };
+    string path;
+#endif
+    std::thread server;
+};
+
+Statistics statistics;
 
 /*
 *  ==========================================================
-*  Snippet Processing Function
+*  Output Logger
 *  ==========================================================
-*  Extracts all snippets from the packet and processes them.
-*  Processing includes calculating remedians for each pixel and detecting a particle.
+*  Saves snippets, remedians, locations, particles and segments without slowing down processing.
+*  Each thread appends fixed-size binary records to its own lock-free ring for each record type.
+*  A background thread drains the rings and writes each record type to its own file in blocks,
+*  where every field of the records in a block is stored as one contiguous column.
+*  A thread whose ring is full waits for the background thread to drain it, so no output is lost.
+*  With --log-drop, snippet, remedian and segment records are dropped instead of waiting, so live processing never stalls on the disk;
+*  locations, particles and their histories are always kept.
+*  The files are converted to the original .csv layouts afterwards by running the program with --convert.
 */
 
-void processSnippets(std::array<uint8_t, PACKET_LENGTH> packet, int frame, int segment, int sensor, int led_config, clock_t clock) {
-    /* <!> Snippet Data Extraction and Processing <!> */
-    // Saves one small snippet from the data, given a position and width
+enum RecordType {
+    SNIPPET_RECORD,
+    REMEDIAN_RECORD,
+    LOCATION_RECORD,
+    PARTICLE_RECORD,
+    HISTORY_RECORD,
+    SEGMENT_RECORD,
+    NUM_RECORD_TYPES
+};
 
-    std::array<int16_t, INTARR_SIZE> snippet;
-    int location;
-    int byteIndex;
+static const char* RECORD_FILES[NUM_RECORD_TYPES] = { "snippets.bin", "remedians.bin", "locations.bin", "particles.bin", "histories.bin", "segments.bin" };
+static const uint32_t BLOCK_MAGIC = 0x424C4450;  // "PDLB" at the start of every block
+static const size_t BLOCK_RECORDS = 4096;  // # of records buffered before a block is written
 
-    // Loops through each electrode position, checking to see if the snippet contains any electrodes
-    for (int electrode = 0; electrode < numElectrodes; electrode++) {
-        location = electrodeLocations[electrode] * 2; // Multiplies the location by 2 because the data is made of 2 bytes per pixel
-        location -= (segment - 1) * 1024;  // Normalizes the location relative to the current segment
+// A snippet and the remedians subtracted from it
+struct SnippetRecord {
+    static const RecordType TYPE = SNIPPET_RECORD;
+    static const size_t CAPACITY = 8192;
+    int32_t frame;
+    uint8_t segment;
+    uint8_t sensor;
+    uint16_t ledConfig;
+    uint16_t stream;
+    uint16_t electrode;
+    uint8_t size;  // # of pixels used
+    Snippet pixels;
+    Snippet remedians;
+};
 
-        // If the location is within the range 0-1023, the segment contains that electrode
-        if (0 <= location && location <= 1023) {
-            // Saves the snippet to the snippet array
-            for (int index = 0; index <= WIDTH * 2; index++) {
-                byteIndex = location - (WIDTH * 2) + (index * 2);  // Calculates the current index of the snippet in the raw packet
-                snippet[index] = twos(packet[byteIndex + 1], packet[byteIndex]);  // Stores the twos complement of the pixel bytes in the snippet array
-            }
+// The remedians of a snippet after they were updated
+struct RemedianRecord {
+    static const RecordType TYPE = REMEDIAN_RECORD;
+    static const size_t CAPACITY = 8192;
+    uint16_t stream;
+    uint16_t electrode;
+    uint8_t size;  // # of pixels used
+    Snippet remedians;
+};
 
-            // Asynchronously calls functions to calculate the remedian of the snippet and process it
-            auto calcRemedian = std::async(std::launch::async, findRemedian, snippet, electrode);
-            pending_futures.push_back(std::move(calcRemedian));
+// The electrode a particle was located at
+struct LocationRecord {
+    static const RecordType TYPE = LOCATION_RECORD;
+    static const size_t CAPACITY = 1024;
+    uint16_t stream;
+    int32_t frame;
+    int32_t location;
+    int16_t weight;
+};
 
-            auto process = std::async(std::launch::async, detectParticle, snippet, frame, segment, electrode, clock);
-            pending_futures.push_back(std::move(process));
+// A detected particle, followed by history records for each electrode
+struct ParticleRecord {
+    static const RecordType TYPE = PARTICLE_RECORD;
+    static const size_t CAPACITY = 1024;
+    uint32_t particle;
+    uint16_t stream;
+    int32_t frame;
+    int16_t weight;
+    uint16_t electrode;
+    uint8_t similar;
+};
 
-            // Writes snippet data if needed
-            if (writeSnippets) {
-                writeSnippetCSV(snippet, frame, segment, sensor, led_config, electrode);
-            }
+// One snippet of an electrode's history when a particle was detected
+struct HistoryRecord {
+    static const RecordType TYPE = HISTORY_RECORD;
+    static const size_t CAPACITY = 32768;
+    uint32_t particle;
+    uint16_t electrode;
+    uint8_t age;  // Age of the snippet, where 0 is the newest
+    uint8_t size;  // # of pixels used
+    Snippet pixels;
+};
+
+// Every pixel of a raw packet
+struct SegmentRecord {
+    static const RecordType TYPE = SEGMENT_RECORD;
+    static const size_t CAPACITY = 4096;
+    int32_t frame;
+    uint8_t segment;
+    std::array<int16_t, PACKET_LENGTH / 2> pixels;
+};
+
+// Position and size of one field of a record, which is stored as a column
+struct Column {
+    size_t offset;
+    size_t size;
+};
+
+#define COLUMN(record, field) Column{ offsetof(record, field), sizeof(record::field) }
+
+static const std::vector<Column> RECORD_COLUMNS[NUM_RECORD_TYPES] = {
+    { COLUMN(SnippetRecord, frame), COLUMN(SnippetRecord, segment), COLUMN(SnippetRecord, sensor), COLUMN(SnippetRecord, ledConfig),
+      COLUMN(SnippetRecord, stream), COLUMN(SnippetRecord, electrode), COLUMN(SnippetRecord, size), COLUMN(SnippetRecord, pixels), COLUMN(SnippetRecord, remedians) },
+    { COLUMN(RemedianRecord, stream), COLUMN(RemedianRecord, electrode), COLUMN(RemedianRecord, size), COLUMN(RemedianRecord, remedians) },
+    { COLUMN(LocationRecord, stream), COLUMN(LocationRecord, frame), COLUMN(LocationRecord, location), COLUMN(LocationRecord, weight) },
+    { COLUMN(ParticleRecord, particle), COLUMN(ParticleRecord, stream), COLUMN(ParticleRecord, frame), COLUMN(ParticleRecord, weight), COLUMN(ParticleRecord, electrode),
+      COLUMN(ParticleRecord, similar) },
+    { COLUMN(HistoryRecord, particle), COLUMN(HistoryRecord, electrode), COLUMN(HistoryRecord, age), COLUMN(HistoryRecord, size),
+      COLUMN(HistoryRecord, pixels) },
+    { COLUMN(SegmentRecord, frame), COLUMN(SegmentRecord, segment), COLUMN(SegmentRecord, pixels) }
+};
+
+static const size_t RECORD_SIZES[NUM_RECORD_TYPES] = {
+    sizeof(SnippetRecord), sizeof(RemedianRecord), sizeof(LocationRecord), sizeof(ParticleRecord), sizeof(HistoryRecord), sizeof(SegmentRecord)
+};
+
+struct BlockHeader {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t count;  // # of records in the block
+    uint32_t recordSize;  // Size of each record, so a file from a different layout is rejected
+};
+
+class RecordRingBase {
+public:
+    virtual ~RecordRingBase() {}
+    // Appends every record in the ring to the end of a byte buffer, returning the # of records
+    virtual size_t drain(std::vector<uint8_t>& output) = 0;
+    virtual RecordType type() const = 0;
+    std::atomic<long long> dropped{ 0 };  // # of records lost because the ring was full
+    std::atomic<long long> waits{ 0 };  // # of records which waited for the ring to be drained
+    std::condition_variable* wake = nullptr;  // Wakes the writer thread early once the ring is half full
+};
+
+// Single-producer, single-consumer ring of records written by one thread
+template <typename Record>
+class RecordRing : public RecordRingBase {
+public:
+    RecordRing() : slots(new Record[Record::CAPACITY]) {}
+
+    bool push(const Record& record) {
+        size_t tail = ringTail.load(std::memory_order_relaxed);
+        if (tail - ringHead.load(std::memory_order_acquire) == Record::CAPACITY) {
+            return false;
+        }
+        slots[tail % Record::CAPACITY] = record;
+        ringTail.store(tail + 1, std::memory_order_release);
+        if (tail - ringHead.load(std::memory_order_relaxed) == Record::CAPACITY / 2) {
+            wake->notify_one();
         }
+        return true;
     }
-}
 
-/*
-*  ==========================================================
-*  Main Function
-*  ==========================================================
-*/
+    size_t drain(std::vector<uint8_t>& output) override {
+        size_t head = ringHead.load(std::memory_order_relaxed);
+        size_t tail = ringTail.load(std::memory_order_acquire);
+        for (size_t index = head; index < tail; index++) {
+            const uint8_t* record = reinterpret_cast<const uint8_t*>(&slots[index % Record::CAPACITY]);
+            output.insert(output.end(), record, record + sizeof(Record));
+        }
+        ringHead.store(tail, std::memory_order_release);
+        return tail - head;
+    }
 
-int main(int argc, char* argv[]) {
+    RecordType type() const override {
+        return Record::TYPE;
+    }
 
-    std::array<uint8_t, PACKET_LENGTH> packet;
-    boost::asio::io_context io_service; // I/O context needed for reading the ethernet data
+private:
+    std::unique_ptr<Record[]> slots;
+    std::atomic<size_t> ringHead{ 0 };
+    std::atomic<size_t> ringTail{ 0 };
+};
 
-    /* <!> Input Parameters Processing <!> */
-    // Reads all data inputted to the program.
-    if (argc > 1) {  // If arguments are given to the program
-        dataPath = argv[1];
-        writeFile = std::stoi(argv[2]);
-        writeSnippets = std::stoi(argv[3]);
-        writeRemedians = std::stoi(argv[4]);
-        writeParticles = std::stoi(argv[5]);
-        for (int index = 5; index < argc; index++) {
-            electrodeLocations.push_back(std::stoi(argv[index]));
+class Logger {
+public:
+    // Removes the files of any previous run and starts the writer thread
+    void start(const string& logDirectory, bool dropRecords) {
+        directory = logDirectory;
+        dropping = dropRecords;
+        for (int type = 0; type < NUM_RECORD_TYPES; type++) {
+            std::remove(path(type).c_str());
         }
-        numElectrodes = argc - 5;
-    }
-    else {  // If no arguments were given, use default data
-        dataPath = "data.bin";
-        writeFile = false;
-        writeSnippets = false;
-        writeRemedians = false;
-        writeParticles = false;
-        electrodeLocations = { 500, 750, 1000, 1250 };
-        numElectrodes = 4;
+        running = true;
+        writer = std::thread(&Logger::run, this);
     }
 
-    // Expands all vectors to the needed size
-    for (int dynamicSize = 0; dynamicSize < numElectrodes; dynamicSize++) {
-        std::array<std::array<int16_t, INTARR_SIZE>, SNIPPET_DEPTH> emptySnippet = { {} };
-        std::array<std::array<std::array<int16_t, DEPTH>, LAYERS>, INTARR_SIZE> emptyMatrix = { { {} } };
-        std::array<int16_t, INTARR_SIZE> emptyRemedian = {};
+    // Writes every remaining record, then closes the files
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_one();
+        if (writer.joinable()) {
+            writer.join();
+        }
+        for (std::ofstream& file : files) {
+            file.close();
+        }
+    }
 
-        snippets.push_back(emptySnippet);
-        remedianMatrix.push_back(emptyMatrix);
-        remedians.push_back(emptyRemedian);
-        electrodeWeights.push_back(0);
+    // Copies a record into the calling thread's ring, waiting for the writer thread to drain it if it is full
+    // With --log-drop, records only used to plot the raw data are dropped instead of waiting
+    template <typename Record>
+    void writeRecord(const Record& record) {
+        thread_local RecordRing<Record>* ring = nullptr;
+        if (ring == nullptr) {
+            ring = addRing<Record>();
+        }
+        if (ring->push(record)) {
+            return;
+        }
+        bool droppable = Record::TYPE == SNIPPET_RECORD || Record::TYPE == REMEDIAN_RECORD || Record::TYPE == SEGMENT_RECORD;
+        if ((dropping && droppable) || !running.load(std::memory_order_acquire)) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        ring->waits.fetch_add(1, std::memory_order_relaxed);
+        while (!ring->push(record)) {
+            if (!running.load(std::memory_order_acquire)) {
+                ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            wake.notify_one();
+            std::this_thread::yield();
+        }
     }
 
-    cout << "C++ Program Start" << endl;
+    void report() {
+        long long dropped = 0;
+        long long waits = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::unique_ptr<RecordRingBase>& ring : rings) {
+            dropped += ring->dropped;
+            waits += ring->waits;
+        }
+        if (waits > 0) {
+            cout << "Logger: " << waits << " records waited for a full ring to be written" << endl;
+        }
+        if (dropped > 0) {
+            cout << "Logger: " << dropped << " records dropped" << endl;
+        }
+    }
 
-    /* <!> Ethernet Connection <!> */
-    //listen for new connection
-    boost::system::error_code ec;
-    tcp::acceptor acceptor_(io_service, tcp::endpoint(boost::asio::ip::address::from_string(IP), PORT));
-    tcp::socket socket_(io_service);  // Creates a socket for the connection
-    acceptor_.accept(socket_);  // Accepts the connection
-    cout << "accepted" << endl;
+    string path(int type) const {
+        return directory + "/" + RECORD_FILES[type];
+    }
 
-    int count = 0;
-    int iter = 453320;
-    // Continuously listens for new data
-    while (true) {
+private:
+    static constexpr int FLUSH_INTERVAL = 10;  // Milliseconds between each time the rings are drained
 
-        // Starts a clock to time the program
-        std::clock_t start;
-        start = std::clock();
+    template <typename Record>
+    RecordRing<Record>* addRing() {
+        std::lock_guard<std::mutex> lock(mutex);
+        rings.push_back(std::make_unique<RecordRing<Record>>());
+        rings.back()->wake = &wake;
+        return static_cast<RecordRing<Record>*>(rings.back().get());
+    }
 
-        // Reads the packet data when a packet is received
-        packet = read_(socket_);
-        //cout << "message received" << endl;
+    void run() {
+        auto lastWrite = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            wake.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL));
+            drain();
 
-        // Stores the initial packet information
-        int frame = packet[0] << 24 | packet[1] << 16 | packet[2] << 8 | packet[3];
-        int segment = packet[4];
-        int sensor = packet[5];
-        int led_config = packet[6] << 8 | packet[7];
+            // Writes full blocks, or whatever is buffered once a second so the files stay current
+            bool overdue = std::chrono::steady_clock::now() - lastWrite > std::chrono::seconds(1);
+            for (int type = 0; type < NUM_RECORD_TYPES; type++) {
+                if (pending[type].size() >= BLOCK_RECORDS * RECORD_SIZES[type] || (overdue && !pending[type].empty())) {
+                    writeBlock(type);
+                }
+            }
+            if (overdue) {
+                lastWrite = std::chrono::steady_clock::now();
+            }
+        }
+        drain();
+        for (int type = 0; type < NUM_RECORD_TYPES; type++) {
+            if (!pending[type].empty()) {
+                writeBlock(type);
+            }
+        }
+    }
 
-        /* <!> Data Collection and Storage <!> */
-        // Appends the binary data to the data file (given by filePath)
-        if (writeFile) {
-            writeToFile(packet);
+    // Moves the records out of every ring into the pending buffer of their type
+    // The ring list is only changed while holding the mutex, which the writer thread holds here
+    void drain() {
+        for (std::unique_ptr<RecordRingBase>& ring : rings) {
+            ring->drain(pending[ring->type()]);
         }
+    }
 
-        processSnippets(packet, frame, segment, sensor, led_config, start);
+    // Writes the pending records of a type as one block, storing each field as a column
+    void writeBlock(int type) {
+        const std::vector<uint8_t>& records = pending[type];
+        size_t recordSize = RECORD_SIZES[type];
+        size_t count = records.size() / recordSize;
 
-        //writeSegment(frame, segment, packet);
+        std::vector<uint8_t> block(sizeof(BlockHeader) + records.size());
+        BlockHeader header = { BLOCK_MAGIC, (uint32_t)type, (uint32_t)count, (uint32_t)recordSize };
+        std::memcpy(block.data(), &header, sizeof(header));
+        uint8_t* column = block.data() + sizeof(header);
+        for (const Column& field : RECORD_COLUMNS[type]) {
+            for (size_t record = 0; record < count; record++) {
+                std::memcpy(column + record * field.size, records.data() + record * recordSize + field.offset, field.size);
+            }
+            column += count * field.size;
+        }
 
-        // Stops the clock and prints the runtime
-        count += 1;
+        if (!files[type].is_open()) {
+            files[type].open(path(type), std::ios::out | std::ios::binary | std::ios::trunc);
+        }
+        files[type].write((const char*)block.data(), block.size());
+        pending[type].clear();
     }
 
+    string directory = ".";
+    std::vector<std::unique_ptr<RecordRingBase>> rings;
+    std::array<std::vector<uint8_t>, NUM_RECORD_TYPES> pending;
+    std::array<std::ofstream, NUM_RECORD_TYPES> files;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> running{ false };
+    bool dropping = false;  // Whether --log-drop lets full rings drop snippet, remedian and segment records
+    std::thread writer;
+};
+
+Logger logger;
+
+/*
+*  ==========================================================
+*  Particle Write Function
+*  ==========================================================
+*  Writes a detected particle along with the snippet history of every electrode.
+*  Useful for graphing particles as they're received.
+*/
+
+void logParticle(const SensorState& state, int chosenElectrode, int frame, int weight, int similar) {
+    static std::atomic<uint32_t> particleCount{ 0 };
+    uint32_t particle = particleCount++;
+    logger.writeRecord(ParticleRecord{ particle, (uint16_t)state.stream, frame, (int16_t)weight, (uint16_t)chosenElectrode, (uint8_t)similar });
+
+    // The other electrodes may be updated by other lanes while they are copied, so each history is copied as a whole
+    HistoryRecord history = {};
+    history.particle = particle;
+    history.size = parameters.snippetPixels();
+    std::vector<int16_t> rows((size_t)parameters.snippetDepth * history.size);
+    for (int electrode = 0; electrode < state.numElectrodes; electrode++) {
+        history.electrode = electrode;
+        state.detector->readHistory(electrode, rows.data());
+        for (int age = 0; age < parameters.snippetDepth; age++) {
+            history.age = age;
+            std::copy_n(rows.begin() + age * history.size, history.size, history.pixels.begin());
+            logger.writeRecord(history);
+        }
+    }
+}
+
+/*
+*  ==========================================================
+*  Snippet Write Function
+*  ==========================================================
+*  Writes a snippet along with the remedians subtracted from it.
+*  Useful for graphing each snippet individually.
+*/
+
+void logSnippet(const SensorState& state, const Snippet& data, int frame, int segment, int led_config, int electrode) {
+    SnippetRecord record{};
+    record.frame = frame;
+    record.segment = segment;
+    record.sensor = state.sensor;
+    record.ledConfig = led_config;
+    record.stream = state.stream;
+    record.electrode = electrode;
+    record.size = parameters.snippetPixels();
+    record.pixels = data;
+    std::copy_n(state.detector->remedian(electrode), record.size, record.remedians.begin());
+    logger.writeRecord(record);
+}
+
+/*
+*  ==========================================================
+*  Remedian Write Function
+*  ==========================================================
+*  Writes all pixel remedians for a snippet.
+*  Useful for tracking remedian values in case of error.
+*/
+
+void logRemedians(const SensorState& state, int electrode) {
+    RemedianRecord record{};
+    record.stream = state.stream;
+    record.electrode = electrode;
+    record.size = parameters.snippetPixels();
+    std::copy_n(state.detector->remedian(electrode), record.size, record.remedians.begin());
+    logger.writeRecord(record);
+}
+
+/*
+*  ==========================================================
+*  Location Write Function
+*  ==========================================================
+*  Writes the location of a particle.
+*  Useful for verifying particle locations using post-processed data.
+*/
+
+void logLocation(const SensorState& state, int frame, int electrode, int16_t weight) {
+    logger.writeRecord(LocationRecord{ (uint16_t)state.stream, frame, state.electrodeLocations[electrode], weight });
+}
+
+/*
+*  ==========================================================
+*  Segment Write Function
+*  ==========================================================
+*  Writes every pixel of a segment.
+*  Useful for plotting the full raw data.
+*/
+
+void logSegment(int frame, int segment, const std::array<uint8_t, PACKET_LENGTH>& packet) {
+    SegmentRecord record;
+    record.frame = frame;
+    record.segment = segment;
+    decodePixels(packet.data(), 0, PACKET_LENGTH / 2, record.pixels.data());
+    logger.writeRecord(record);
+}
+
+/*
+*  ==========================================================
+*  Live Telemetry
+*  ==========================================================
+*  Publishes the weights of every frame, each detected particle and sampled snippet images to a ring in shared memory with --telemetry,
+*  so a live viewer can attach and detach at any time without touching the files or slowing down detection.
+*  The thread deciding a frame copies its records into its own lock-free ring, like the logger, and never waits on a viewer.
+*  A publisher thread drains those rings into the shared ring every millisecond, so the shared ring has a single producer.
+*  Each slot of the shared ring has a sequence number, which is odd while the slot is written and 2 * (index + 1) once record index is in it.
+*  Readers keep their own position and check the sequence before and after copying a record, so any number of readers can follow
+*  the ring without locks; a reader which falls more than a ring behind skips ahead and counts the records it missed.
+*  Snippet images are the history of an electrode, newest row first, split over as many records as they need:
+*  the particle's electrode is sent with every particle, and every --telemetry-sample frames the next electrode in turn is sent.
+*/
+
+enum TelemetryType {
+    WEIGHTS_TELEMETRY,  // Weights of consecutive electrodes in a frame
+    PARTICLE_TELEMETRY,  // A particle located at an electrode
+    SNIPPET_TELEMETRY  // Consecutive rows of an electrode's snippet history
+};
+
+struct TelemetryRecord {
+    static const RecordType TYPE = NUM_RECORD_TYPES;  // Drained by the telemetry publisher instead of the logger
+    static const size_t CAPACITY = 4096;
+    static constexpr int VALUES = 126;
+    uint8_t type;
+    uint8_t sensor;
+    uint16_t stream;
+    int32_t frame;
+    uint16_t electrode;  // First electrode of the weights, or the electrode of the particle or snippet
+    uint16_t count;  // # of weights, or # of pixels in each row of the snippet
+    uint16_t firstRow;  // Age of the first row of the snippet
+    uint16_t rows;  // # of rows of the snippet
+    int16_t weight;  // Weight of the particle
+    uint8_t similar;  // Whether more than one electrode passed the threshold
+    int64_t arrival;  // Arrival time of the frame's latest packet on the steady clock, in nanoseconds
+    int16_t values[VALUES];
+};
+
+static const uint32_t TELEMETRY_MAGIC = 0x54454450;  // "PDET"
+static const uint32_t TELEMETRY_VERSION = 1;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The telemetry ring needs lock-free atomics to be shared between processes");
+
+// Start of the shared memory, followed by the slots
+struct TelemetryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slotSize;
+    std::atomic<uint64_t> published;  // # of records published
+};
+
+struct TelemetrySlot {
+    std::atomic<uint64_t> sequence;
+    TelemetryRecord record;
+};
+
+class Telemetry {
+public:
+    // Creates the shared memory, replacing any left by an earlier run, and starts the publisher
+    void start(const string& name, uint32_t slots, int sample) {
+        this->name = name;
+        this->sample = std::max(1, sample);
+        boost::interprocess::shared_memory_object::remove(name.c_str());
+        memory = boost::interprocess::shared_memory_object(boost::interprocess::create_only, name.c_str(), boost::interprocess::read_write);
+        memory.truncate(sizeof(TelemetryHeader) + (uint64_t)slots * sizeof(TelemetrySlot));
+        region = boost::interprocess::mapped_region(memory, boost::interprocess::read_write);
+        header = new (region.get_address()) TelemetryHeader{ TELEMETRY_MAGIC, TELEMETRY_VERSION, slots, sizeof(TelemetrySlot), { 0 } };
+        ring = reinterpret_cast<TelemetrySlot*>(header + 1);
+        for (uint32_t slot = 0; slot < slots; slot++) {
+            new (&ring[slot].sequence) std::atomic<uint64_t>(0);
+        }
+        running = true;
+        publisher = std::thread(&Telemetry::run, this);
+    }
+
+    // Publishes every remaining record, then removes the name so no new reader attaches
+    void stop() {
+        if (!publisher.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_one();
+        publisher.join();
+        boost::interprocess::shared_memory_object::remove(name.c_str());
+    }
+
+    bool enabled() const {
+        return header != nullptr;
+    }
+
+    // Publishes the weights and decision of a frame, with the snippet images of the particle's electrode and of the sampled electrode
+    void publishFrame(const SensorState& state, int frame, const int16_t* weights, int electrode, bool similar, Timestamp arrival) {
+        TelemetryRecord record = {};
+        record.sensor = state.sensor;
+        record.stream = state.stream;
+        record.frame = frame;
+        record.arrival = std::chrono::duration_cast<std::chrono::nanoseconds>(arrival.time_since_epoch()).count();
+
+        record.type = WEIGHTS_TELEMETRY;
+        for (int first = 0; first < state.numElectrodes; first += TelemetryRecord::VALUES) {
+            record.electrode = first;
+            record.count = std::min(TelemetryRecord::VALUES, state.numElectrodes - first);
+            for (int index = 0; index < record.count; index++) {
+                record.values[index] = weights[(first + index) * state.weightOffsets];
+            }
+            push(record);
+        }
+
+        if (electrode >= 0) {
+            record.type = PARTICLE_TELEMETRY;
+            record.electrode = electrode;
+            record.count = 0;
+            record.weight = weights[electrode * state.weightOffsets];
+            record.similar = similar;
+            push(record);
+            publishSnippet(state, record, electrode);
+        }
+        if (frame % sample == 0 && state.numElectrodes > 0) {
+            publishSnippet(state, record, (unsigned int)(frame / sample) % state.numElectrodes);
+        }
+    }
+
+    void report() {
+        if (!enabled()) {
+            return;
+        }
+        long long dropped = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (std::unique_ptr<RecordRingBase>& ring : rings) {
+                dropped += ring->dropped;
+            }
+        }
+        cout << "Telemetry: " << header->published.load() << " records published to " << name << ", " << dropped << " dropped" << endl;
+    }
+
+private:
+    static constexpr int PUBLISH_INTERVAL = 1;  // Milliseconds between each time the rings are drained
+
+    // Sends an electrode's snippet history, as many rows at a time as fit in a record
+    void publishSnippet(const SensorState& state, TelemetryRecord& record, int electrode) {
+        int pixels = parameters.snippetPixels();
+        std::vector<int16_t> rows((size_t)parameters.snippetDepth * pixels);
+        state.detector->readHistory(electrode, rows.data());
+        record.type = SNIPPET_TELEMETRY;
+        record.electrode = electrode;
+        record.count = pixels;
+        int rowsPerRecord = TelemetryRecord::VALUES / pixels;
+        for (int first = 0; first < parameters.snippetDepth; first += rowsPerRecord) {
+            record.firstRow = first;
+            record.rows = std::min(rowsPerRecord, parameters.snippetDepth - first);
+            std::copy_n(rows.begin() + first * pixels, record.rows * pixels, record.values);
+            push(record);
+        }
+    }
+
+    // Copies a record into the calling thread's ring, dropping it if the ring is full
+    void push(const TelemetryRecord& record) {
+        thread_local RecordRing<TelemetryRecord>* threadRing = nullptr;
+        if (threadRing == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex);
+            rings.push_back(std::make_unique<RecordRing<TelemetryRecord>>());
+            rings.back()->wake = &wake;
+            threadRing = static_cast<RecordRing<TelemetryRecord>*>(rings.back().get());
+        }
+        if (!threadRing->push(record)) {
+            threadRing->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            wake.wait_for(lock, std::chrono::milliseconds(PUBLISH_INTERVAL));
+            publish();
+        }
+        publish();
+    }
+
+    // Moves the records of every ring into the shared ring, holding the mutex so the ring list doesn't change
+    void publish() {
+        for (std::unique_ptr<RecordRingBase>& threadRing : rings) {
+            pending.clear();
+            size_t count = threadRing->drain(pending);
+            const TelemetryRecord* records = reinterpret_cast<const TelemetryRecord*>(pending.data());
+            for (size_t index = 0; index < count; index++) {
+                uint64_t published = header->published.load(std::memory_order_relaxed);
+                TelemetrySlot& slot = ring[published % header->slots];
+                slot.sequence.store(published * 2 + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                std::memcpy(&slot.record, &records[index], sizeof(TelemetryRecord));
+                slot.sequence.store(published * 2 + 2, std::memory_order_release);
+                header->published.store(published + 1, std::memory_order_release);
+            }
+        }
+    }
+
+    string name;
+    int sample = 100;  // Frames between each sampled snippet image
+    boost::interprocess::shared_memory_object memory;
+    boost::interprocess::mapped_region region;
+    TelemetryHeader* header = nullptr;
+    TelemetrySlot* ring = nullptr;
+    std::vector<std::unique_ptr<RecordRingBase>> rings;
+    std::vector<uint8_t> pending;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool running = false;
+    std::thread publisher;
+};
+
+Telemetry telemetry;
+
+// Follows the shared ring of a running program from another process
+class TelemetryReader {
+public:
+    // Opens the shared memory, returning false if no program is publishing under the name
+    bool attach(const string& name) {
+        try {
+            memory = boost::interprocess::shared_memory_object(boost::interprocess::open_only, name.c_str(), boost::interprocess::read_only);
+            region = boost::interprocess::mapped_region(memory, boost::interprocess::read_only);
+        }
+        catch (const boost::interprocess::interprocess_exception&) {
+            return false;
+        }
+        header = static_cast<const TelemetryHeader*>(region.get_address());
+        if (region.get_size() < sizeof(TelemetryHeader) || header->magic != TELEMETRY_MAGIC || header->version != TELEMETRY_VERSION
+            || header->slotSize != sizeof(TelemetrySlot) || region.get_size() < sizeof(TelemetryHeader) + (uint64_t)header->slots * sizeof(TelemetrySlot)) {
+            header = nullptr;
+            return false;
+        }
+        ring = reinterpret_cast<const TelemetrySlot*>(header + 1);
+        position = header->published.load(std::memory_order_acquire);  // Starts with the next record published
+        return true;
+    }
+
+    // Copies the next record, returning false if none was published since the last one
+    bool next(TelemetryRecord& record) {
+        while (true) {
+            uint64_t published = header->published.load(std::memory_order_acquire);
+            if (position >= published) {
+                return false;
+            }
+            if (published - position > header->slots) {
+                missed += published - header->slots - position;
+                position = published - header->slots;
+            }
+            const TelemetrySlot& slot = ring[position % header->slots];
+            uint64_t expected = position * 2 + 2;
+            if (slot.sequence.load(std::memory_order_acquire) == expected) {
+                std::memcpy(&record, &slot.record, sizeof(TelemetryRecord));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) == expected) {
+                    position++;
+                    return true;
+                }
+            }
+            // The publisher already reused the slot for a later record
+            missed++;
+            position++;
+        }
+    }
+
+    long long missed = 0;  // # of records overwritten before they were read
+
+private:
+    boost::interprocess::shared_memory_object memory;
+    boost::interprocess::mapped_region region;
+    const TelemetryHeader* header = nullptr;
+    const TelemetrySlot* ring = nullptr;
+    uint64_t position = 0;  // Index of the next record to read
+};
+
+// Prints the records of a running program as .csv lines, for viewers which read them from a pipe
+// Each line starts with the record type, stream, sensor and frame, followed by the record's fields and values
+void readTelemetry(const string& name, long long records) {
+    TelemetryReader reader;
+    while (!reader.attach(name)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    long long read = 0;
+    long long missed = 0;
+    TelemetryRecord record;
+    while (records == 0 || read < records) {
+        if (!reader.next(record)) {
+            if (reader.missed != missed) {
+                cout << "missed," << reader.missed - missed << "\n";
+                missed = reader.missed;
+            }
+            cout.flush();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        int values = 0;
+        if (record.type == WEIGHTS_TELEMETRY) {
+            cout << "weights," << record.stream << "," << (int)record.sensor << "," << record.frame << "," << record.electrode;
+            values = record.count;
+        }
+        else if (record.type == PARTICLE_TELEMETRY) {
+            cout << "particle," << record.stream << "," << (int)record.sensor << "," << record.frame << "," << record.electrode << ","
+                << record.weight << "," << (int)record.similar;
+        }
+        else {
+            cout << "snippet," << record.stream << "," << (int)record.sensor << "," << record.frame << "," << record.electrode << ","
+                << record.firstRow << "," << record.rows << "," << record.count;
+            values = record.rows * record.count;
+        }
+        for (int index = 0; index < values; index++) {
+            cout << "," << record.values[index];
+        }
+        cout << "\n";
+        read++;
+    }
+    cout.flush();
+}
+
+/*
+*  ==========================================================
+*  Capture Writer
+*  ==========================================================
+*  Writes all binary data to a file given by the file path when calling the program (default "data.bin").
+*  Packets are copied into large aligned batches, which a background thread writes with a single call each.
+*  The file is rotated by size or time at the start of a frame, and every new file begins with the header block
+*  that start.py put at the start of the first file.
+*  A sidecar index (<file>.idx) stores the byte offset of each frame, so a replay can seek straight to a frame.
+*/
+
+// Byte offset of the first packet of a frame, stored in the sidecar index
+struct FrameIndexEntry {
+    uint64_t frame;
+    uint64_t offset;
+};
+
+class CaptureWriter {
+public:
+    // maxBytes and maxSeconds of 0 never rotate the file
+    void start(const string& capturePath, long long maxBytes, int maxSeconds) {
+        basePath = capturePath;
+        rotateBytes = maxBytes;
+        rotateTime = std::chrono::seconds(maxSeconds);
+
+        // Keeps the header block that start.py wrote, so it can be copied into rotated files
+        std::ifstream existing(basePath, std::ios::in | std::ios::binary | std::ios::ate);
+        if (existing && existing.tellg() % PACKET_LENGTH == HEADER_LENGTH) {
+            header.resize(HEADER_LENGTH);
+            existing.seekg(0);
+            existing.read((char*)header.data(), HEADER_LENGTH);
+        }
+        existing.close();
+
+        for (int batch = 0; batch < NUM_BATCHES; batch++) {
+            freeBatches.push_back(std::make_unique<CaptureBatch>());
+        }
+        current = takeFreeBatch();
+        running = true;
+        writer = std::thread(&CaptureWriter::run, this);
+    }
+
+    // Copies a packet into the current batch, handing the batch to the writer once it is full or old
+    // Connections read by different threads take turns adding their packets
+    void write(const std::array<uint8_t, PACKET_LENGTH>& packet) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (current->packets == 0) {
+            current->started = std::chrono::steady_clock::now();
+        }
+        std::copy(packet.begin(), packet.end(), current->data.begin() + current->packets * PACKET_LENGTH);
+        current->packets++;
+
+        if (current->packets == BATCH_PACKETS || std::chrono::steady_clock::now() - current->started > FLUSH_INTERVAL) {
+            submit();
+        }
+    }
+
+    // Writes the remaining packets, then closes the files
+    void stop() {
+        if (!running) {
+            return;
+        }
+        std::lock_guard<std::mutex> writeLock(writeMutex);
+        if (current->packets > 0) {
+            submit();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        filled.notify_one();
+        writer.join();
+        closeFile();
+    }
+
+    void report() {
+        cout << "Capture: " << totalBytes << " bytes in " << filesOpened << " file(s), " << stalls << " stalls" << endl;
+    }
+
+private:
+    static const int BATCH_PACKETS = 1024;  // # of packets in each batch
+    static const int NUM_BATCHES = 4;  // # of batches which can be filled while others are being written
+    const std::chrono::seconds FLUSH_INTERVAL = std::chrono::seconds(1);  // Longest a packet waits in a partial batch while data is arriving
+
+    struct CaptureBatch {
+        alignas(4096) std::array<uint8_t, BATCH_PACKETS * PACKET_LENGTH> data;
+        int packets = 0;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    std::unique_ptr<CaptureBatch> takeFreeBatch() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (freeBatches.empty()) {
+            stalls++;
+            released.wait(lock, [this] { return !freeBatches.empty(); });
+        }
+        std::unique_ptr<CaptureBatch> batch = std::move(freeBatches.back());
+        freeBatches.pop_back();
+        return batch;
+    }
+
+    void submit() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fullBatches.push_back(std::move(current));
+        }
+        filled.notify_one();
+        current = takeFreeBatch();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            filled.wait(lock, [this] { return !fullBatches.empty() || !running; });
+            if (fullBatches.empty()) {
+                return;
+            }
+            std::unique_ptr<CaptureBatch> batch = std::move(fullBatches.front());
+            fullBatches.pop_front();
+            lock.unlock();
+
+            writeBatch(*batch);
+            batch->packets = 0;
+
+            lock.lock();
+            freeBatches.push_back(std::move(batch));
+            released.notify_one();
+        }
+    }
+
+    // Writes a batch in as few calls as possible, splitting it only where the file is rotated
+    void writeBatch(const CaptureBatch& batch) {
+        int first = 0;  // First packet not yet written
+        for (int packet = 0; packet < batch.packets; packet++) {
+            const uint8_t* data = batch.data.data() + packet * PACKET_LENGTH;
+            uint32_t frame = data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+            if (file != nullptr && frame == lastFrame) {
+                continue;
+            }
+
+            // A new frame starts here, so the file can be rotated before it
+            uint64_t pendingBytes = (uint64_t)(packet - first) * PACKET_LENGTH;
+            if (file == nullptr || needsRotation(pendingBytes)) {
+                writePackets(batch, first, packet);
+                first = packet;
+                openNextFile();
+                pendingBytes = 0;
+            }
+            index.push_back({ frame, fileBytes + pendingBytes });
+            lastFrame = frame;
+        }
+        writePackets(batch, first, batch.packets);
+
+        std::fwrite(index.data(), sizeof(FrameIndexEntry), index.size(), indexFile);
+        std::fflush(indexFile);
+        index.clear();
+    }
+
+    void writePackets(const CaptureBatch& batch, int first, int last) {
+        if (last > first) {
+            std::fwrite(batch.data.data() + first * PACKET_LENGTH, PACKET_LENGTH, last - first, file);
+            fileBytes += (uint64_t)(last - first) * PACKET_LENGTH;
+            totalBytes += (long long)(last - first) * PACKET_LENGTH;
+        }
+    }
+
+    bool needsRotation(uint64_t pendingBytes) const {
+        return (rotateBytes > 0 && (long long)(fileBytes + pendingBytes) >= rotateBytes)
+            || (rotateTime.count() > 0 && std::chrono::steady_clock::now() - opened >= rotateTime);
+    }
+
+    // Opens the first file in append mode (after start.py's header), or a new rotated file starting with the header
+    void openNextFile() {
+        closeFile();
+        string path = basePath;
+        if (filesOpened == 0) {
+            file = std::fopen(path.c_str(), "ab");
+        }
+        else {
+            size_t dot = basePath.find_last_of('.');
+            size_t slash = basePath.find_last_of("/\\");
+            if (dot == string::npos || (slash != string::npos && dot < slash)) {
+                dot = basePath.size();
+            }
+            path = basePath.substr(0, dot) + "." + std::to_string(filesOpened) + basePath.substr(dot);
+            file = std::fopen(path.c_str(), "wb");
+            if (file != nullptr) {
+                std::fwrite(header.data(), 1, header.size(), file);
+            }
+        }
+        if (file == nullptr) {
+            std::cerr << "Capture: could not open " << path << endl;
+            std::exit(1);
+        }
+        std::setvbuf(file, nullptr, _IONBF, 0);
+        std::fseek(file, 0, SEEK_END);
+        fileBytes = std::ftell(file);
+        indexFile = std::fopen((path + ".idx").c_str(), "wb");
+        opened = std::chrono::steady_clock::now();
+        filesOpened++;
+    }
+
+    void closeFile() {
+        if (file != nullptr) {
+            std::fclose(file);
+            file = nullptr;
+        }
+        if (indexFile != nullptr) {
+            std::fwrite(index.data(), sizeof(FrameIndexEntry), index.size(), indexFile);
+            index.clear();
+            std::fclose(indexFile);
+            indexFile = nullptr;
+        }
+    }
+
+    string basePath;
+    std::vector<uint8_t> header;
+    long long rotateBytes = 0;
+    std::chrono::seconds rotateTime{ 0 };
+
+    std::unique_ptr<CaptureBatch> current;  // Batch being filled by the reader
+    std::vector<std::unique_ptr<CaptureBatch>> freeBatches;
+    std::deque<std::unique_ptr<CaptureBatch>> fullBatches;
+    std::mutex mutex;
+    std::condition_variable filled;
+    std::condition_variable released;
+    std::mutex writeMutex;  // Held while a packet is added to the current batch
+    bool running = false;
+    std::thread writer;
+    long long stalls = 0;  // # of times the reader waited for a free batch
+
+    // Only used by the writer thread
+    std::FILE* file = nullptr;
+    std::FILE* indexFile = nullptr;
+    uint64_t fileBytes = 0;
+    std::chrono::steady_clock::time_point opened;
+    std::vector<FrameIndexEntry> index;
+    uint32_t lastFrame = 0;
+    int filesOpened = 0;
+    long long totalBytes = 0;
+};
+
+CaptureWriter capture;
+
+/*
+*  ==========================================================
+*  Remedian Engine
+*  ==========================================================
+*  Calculates the remedian for every pixel of a snippet at once.
+*  Each layer is a ring buffer with a running sum, so inserting a value never shifts or re-sums the layer.
+*  The layers are stored with the pixels innermost, so each step is a single loop the compiler vectorizes.
+*  A layer is full once LAYER_DEPTH values were inserted since it was last cleared, so a pixel value of 0 is valid data.
+*  With MEDIAN, the engine is a true remedian (--background=median): each layer passes on its median once it is full and starts over,
+*  and the remedian is the median of the deepest layer, which keeps the latest LAYER_DEPTH medians.
+*  The median is found with a sorting network applied to whole rows, so each comparator is a branch-free min and max over every pixel.
+*  Only one snippet in LAYER_DEPTH fills a layer, so the median background costs less per snippet than the mean.
+*/
+
+// Comparators of Batcher's odd-even merge sort for count values, keeping only those the two middle values depend on
+// The network is built for the next power of two, where comparators touching the missing values never swap and are left out
+std::vector<std::pair<int, int>> medianNetwork(int count) {
+    int size = 1;
+    while (size < count) {
+        size *= 2;
+    }
+    std::vector<std::pair<int, int>> network;
+    for (int p = 1; p < size; p *= 2) {
+        for (int k = p; k >= 1; k /= 2) {
+            for (int j = k % p; j + k < size; j += 2 * k) {
+                for (int i = 0; i < std::min(k, size - j - k); i++) {
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p) && i + j + k < count) {
+                        network.push_back({ i + j, i + j + k });
+                    }
+                }
+            }
+        }
+    }
+
+    // Walks back from the middle values, keeping each comparator which feeds one that is kept
+    std::vector<bool> needed(count, false);
+    needed[(count - 1) / 2] = true;
+    needed[count / 2] = true;
+    std::vector<std::pair<int, int>> pruned;
+    for (auto comparator = network.rbegin(); comparator != network.rend(); ++comparator) {
+        if (needed[comparator->first] || needed[comparator->second]) {
+            needed[comparator->first] = true;
+            needed[comparator->second] = true;
+            pruned.push_back(*comparator);
+        }
+    }
+    std::reverse(pruned.begin(), pruned.end());
+    return pruned;
+}
+
+// Median of the first count values, averaging the two middle values when the count is even
+// Only used while the deepest layer is still filling up, so it doesn't need to be fast
+int16_t partialMedian(int16_t* values, int count) {
+    std::nth_element(values, values + count / 2, values + count);
+    int upper = values[count / 2];
+    if (count % 2 == 1) {
+        return upper;
+    }
+    int lower = *std::max_element(values, values + count / 2);
+    return (lower + upper) / 2;
+}
+
+template <size_t PIXELS, size_t LAYER_DEPTH, size_t NUM_LAYERS, bool MEDIAN>
+class RemedianEngine {
+public:
+    static const size_t LANES = (PIXELS + 15) / 16 * 16;  // Pixel count padded to a multiple of the vector width
+    typedef std::array<int16_t, LANES> Row;
+
+    // Inserts a snippet into the first layer, cascading the average of each full layer into the next
+    void update(const int16_t* snippet, std::array<int16_t, PIXELS>& remedian) {
+        Row input = {};
+        std::copy_n(snippet, PIXELS, input.begin());
+        if (MEDIAN) {
+            updateMedian(input, remedian);
+            return;
+        }
+        push(0, input);
+
+        if (fills[0] == LAYER_DEPTH) {
+            Row prevLayerAvg;
+            average(0, prevLayerAvg);
+
+            // Inserts the previous layer's average into the next layer, repeating while each successive layer is full
+            size_t layer = 1;
+            while (layer < NUM_LAYERS - 1) {
+                push(layer, prevLayerAvg);
+                if (fills[layer] < LAYER_DEPTH) {
+                    break;
+                }
+                average(layer, prevLayerAvg);
+                layer++;
+            }
+
+            // Inserts the second-last layer's average into the deepest layer (if it was full)
+            if (layer == NUM_LAYERS - 1) {
+                push(NUM_LAYERS - 1, prevLayerAvg);
+            }
+
+            // Clears all full layers below the last one that was filled
+            for (size_t index = 0; index + 1 < layer; index++) {
+                clear(index);
+            }
+        }
+
+        // Sets the new remedian for each pixel to the average of the deepest layer
+        Row deepest;
+        average(NUM_LAYERS - 1, deepest);
+        std::copy(deepest.begin(), deepest.begin() + PIXELS, remedian.begin());
+    }
+
+    // Writes every layer without its padding
+    void save(StateWriter& writer) const {
+        for (size_t layer = 0; layer < NUM_LAYERS; layer++) {
+            writer.write<uint32_t>(heads[layer]);
+            writer.write<uint32_t>(fills[layer]);
+            for (size_t slot = 0; slot < LAYER_DEPTH; slot++) {
+                writer.write(values[layer][slot].data(), PIXELS);
+            }
+            writer.write(sums[layer].data(), PIXELS);
+        }
+    }
+
+    // Restores the layers written by save, along with the remedian they gave
+    void load(StateReader& reader, const std::array<int16_t, PIXELS>& remedian) {
+        for (size_t layer = 0; layer < NUM_LAYERS; layer++) {
+            heads[layer] = reader.read<uint32_t>() % LAYER_DEPTH;
+            fills[layer] = std::min<size_t>(reader.read<uint32_t>(), LAYER_DEPTH);
+            for (size_t slot = 0; slot < LAYER_DEPTH; slot++) {
+                reader.read(values[layer][slot].data(), PIXELS);
+            }
+            reader.read(sums[layer].data(), PIXELS);
+        }
+        std::copy(remedian.begin(), remedian.end(), remedianRow.begin());
+        deepestChanged = false;
+    }
+
+private:
+    // Inserts a snippet into the first layer, passing the median of each full layer to the next and clearing it
+    void updateMedian(const Row& input, std::array<int16_t, PIXELS>& remedian) {
+        push(0, input);
+        size_t layer = 0;
+        while (layer < NUM_LAYERS - 1 && fills[layer] == LAYER_DEPTH) {
+            Row layerMedian;
+            median(layer, layerMedian);
+            clear(layer);
+            layer++;
+            push(layer, layerMedian);
+        }
+
+        // The remedian only changes when the deepest layer does
+        if (deepestChanged) {
+            deepestMedian();
+            deepestChanged = false;
+        }
+        std::copy(remedianRow.begin(), remedianRow.begin() + PIXELS, remedian.begin());
+    }
+
+    // Sorts a copy of a full layer just far enough to find the median of each pixel
+    void median(size_t layer, Row& row) const {
+        static const std::vector<std::pair<int, int>> network = medianNetwork(LAYER_DEPTH);
+        alignas(64) std::array<Row, LAYER_DEPTH> sorted = values[layer];
+        for (const std::pair<int, int>& comparator : network) {
+            // Works on copies of the rows, so the compiler knows they don't overlap and vectorizes the loop
+            const Row low = sorted[comparator.first];
+            const Row high = sorted[comparator.second];
+            Row smaller;
+            Row larger;
+            for (size_t pixel = 0; pixel < LANES; pixel++) {
+                smaller[pixel] = std::min(low[pixel], high[pixel]);
+                larger[pixel] = std::max(low[pixel], high[pixel]);
+            }
+            sorted[comparator.first] = smaller;
+            sorted[comparator.second] = larger;
+        }
+        const Row& lower = sorted[(LAYER_DEPTH - 1) / 2];
+        const Row& upper = sorted[LAYER_DEPTH / 2];
+        for (size_t pixel = 0; pixel < LANES; pixel++) {
+            row[pixel] = ((int32_t)lower[pixel] + upper[pixel]) / 2;
+        }
+    }
+
+    // Median of the deepest layer, which is only partly filled until LAYER_DEPTH rows reached it
+    void deepestMedian() {
+        size_t layer = NUM_LAYERS - 1;
+        if (fills[layer] == LAYER_DEPTH) {
+            median(layer, remedianRow);
+            return;
+        }
+        if (fills[layer] == 0) {
+            remedianRow.fill(0);
+            return;
+        }
+        std::array<int16_t, LAYER_DEPTH> column;
+        for (size_t pixel = 0; pixel < LANES; pixel++) {
+            for (size_t slot = 0; slot < fills[layer]; slot++) {
+                column[slot] = values[layer][slot][pixel];
+            }
+            remedianRow[pixel] = partialMedian(column.data(), fills[layer]);
+        }
+    }
+
+    // Inserts a row into a layer, replacing the oldest row once the layer is full
+    void push(size_t layer, const Row& row) {
+        if (layer == NUM_LAYERS - 1) {
+            deepestChanged = true;
+        }
+        Row& slot = values[layer][heads[layer]];
+        std::array<int32_t, LANES>& sum = sums[layer];
+        if (fills[layer] == LAYER_DEPTH) {
+            for (size_t pixel = 0; pixel < LANES; pixel++) {
+                sum[pixel] += row[pixel] - slot[pixel];
+                slot[pixel] = row[pixel];
+            }
+        }
+        else {
+            for (size_t pixel = 0; pixel < LANES; pixel++) {
+                sum[pixel] += row[pixel];
+                slot[pixel] = row[pixel];
+            }
+            fills[layer]++;
+        }
+        heads[layer] = (heads[layer] + 1) % LAYER_DEPTH;
+    }
+
+    // Calculates the average of a layer, dividing by the layer depth even if it isn't full (like getAverage)
+    void average(size_t layer, Row& avg) const {
+        const std::array<int32_t, LANES>& sum = sums[layer];
+        for (size_t pixel = 0; pixel < LANES; pixel++) {
+            avg[pixel] = sum[pixel] / (int32_t)LAYER_DEPTH;
+        }
+    }
+
+    void clear(size_t layer) {
+        sums[layer].fill(0);
+        heads[layer] = 0;
+        fills[layer] = 0;
+    }
+
+    alignas(64) std::array<std::array<Row, LAYER_DEPTH>, NUM_LAYERS> values = {};
+    alignas(64) std::array<std::array<int32_t, LANES>, NUM_LAYERS> sums = {};
+    std::array<size_t, NUM_LAYERS> heads = {};
+    std::array<size_t, NUM_LAYERS> fills = {};
+    Row remedianRow = {};  // Median of the deepest layer, for the median background
+    bool deepestChanged = false;
+};
+
+/*
+*  ==========================================================
+*  Detection Kernels
+*  ==========================================================
+*  The remedian and snippet history loops only unroll and vectorize when their sizes are known when compiling,
+*  so a detector is compiled for each supported set of (WIDTH, SNIPPET_DEPTH, DEPTH, LAYERS) in the KERNELS table, for both backgrounds.
+*  The detector matching the parameters given at startup is picked from the table, so one program serves every chip layout.
+*  Any other parameters use the generic detector, which gives the same results with sizes chosen at runtime.
+*/
+
+template <size_t RADIUS, size_t HISTORY, size_t LAYER_DEPTH, size_t NUM_LAYERS, bool MEDIAN>
+class KernelDetector : public Detector {
+public:
+    static const size_t PIXELS = RADIUS * 2 + 1;
+
+    explicit KernelDetector(int electrodes) : engines(electrodes), histories(electrodes), remedians(electrodes) {}
+
+    // Publishes each new remedian as a whole, so other threads never read one that is half updated
+    void updateRemedian(int electrode, const int16_t* snippet) override {
+        engines[electrode].update(snippet, remedians[electrode].next());
+        remedians[electrode].publish();
+    }
+
+    int16_t detect(int electrode, const int16_t* snippet) override {
+        // Subtracts the remedian value for each pixel in the snippet
+        std::array<int16_t, PIXELS> subbedSnippet;
+        const std::array<int16_t, PIXELS>& remedian = remedians[electrode].current();
+        for (size_t pixel = 0; pixel < PIXELS; pixel++) {
+            subbedSnippet[pixel] = abs(snippet[pixel] - remedian[pixel]);
+        }
+
+        histories[electrode].push(subbedSnippet);
+        return histories[electrode].weight();
+    }
+
+    int16_t weight(int electrode, int offset) const override {
+        return histories[electrode].weight(offset);
+    }
+
+    const int16_t* remedian(int electrode) const override {
+        return remedians[electrode].current().data();
+    }
+
+    const int16_t* row(int electrode, int age) const override {
+        return histories[electrode].row(age).data();
+    }
+
+    void readRemedian(int electrode, int16_t* remedian) const override {
+        std::array<int16_t, PIXELS> copy;
+        remedians[electrode].read(copy);
+        std::copy(copy.begin(), copy.end(), remedian);
+    }
+
+    void readHistory(int electrode, int16_t* rows) const override {
+        histories[electrode].read(rows);
+    }
+
+    void saveState(int electrode, uint8_t* bytes) const override {
+        StateWriter writer(bytes);
+        writer.write(remedians[electrode].current().data(), PIXELS);
+        engines[electrode].save(writer);
+        histories[electrode].save(writer);
+    }
+
+    void loadState(int electrode, const uint8_t* bytes) override {
+        StateReader reader(bytes);
+        std::array<int16_t, PIXELS> remedian;
+        reader.read(remedian.data(), PIXELS);
+        remedians[electrode].reset(remedian);
+        engines[electrode].load(reader, remedian);
+        histories[electrode].load(reader);
+    }
+
+    bool specialized() const override {
+        return true;
+    }
+
+private:
+    std::vector<RemedianEngine<PIXELS, LAYER_DEPTH, NUM_LAYERS, MEDIAN>> engines;
+    std::vector<SnippetHistory<PIXELS, HISTORY, LAYER_DEPTH>> histories;
+    std::vector<Published<std::array<int16_t, PIXELS>>> remedians;
+};
+
+// Same calculations as KernelDetector with every size given at runtime, for parameters which aren't in the KERNELS table
+class GenericDetector : public Detector {
+public:
+    GenericDetector(int electrodes, const DetectionParameters& parameters)
+        : pixels(parameters.snippetPixels()), history(parameters.snippetDepth), layerDepth(parameters.depth), numLayers(parameters.layers),
+          median(parameters.background == MEDIAN_BACKGROUND), network(medianNetwork(parameters.depth)),
+          sortedStride((pixels + SORT_BLOCK - 1) / SORT_BLOCK * SORT_BLOCK), electrodes(electrodes) {
+        for (Electrode& state : this->electrodes) {
+            state.values.assign((size_t)numLayers * layerDepth * pixels, 0);
+            state.sums.assign((size_t)numLayers * pixels, 0);
+            state.heads.assign(numLayers, 0);
+            state.fills.assign(numLayers, 0);
+            state.remedian.reset(std::vector<int16_t>(pixels, 0));
+            state.rows.assign((size_t)history * pixels, 0);
+            state.prefix.assign(history + 1, 0);
+            state.count = history;
+            state.prevLayerAvg.assign(pixels, 0);
+            if (median) {
+                state.sorted.assign((size_t)layerDepth * sortedStride, 0);
+                state.remedianRow.assign(pixels, 0);
+            }
+        }
+    }
+
+    // Follows RemedianEngine::update
+    void updateRemedian(int electrode, const int16_t* snippet) override {
+        Electrode& state = electrodes[electrode];
+        if (median) {
+            updateMedian(state, snippet);
+            return;
+        }
+        std::vector<int16_t>& prevLayerAvg = state.prevLayerAvg;
+        push(state, 0, snippet);
+
+        if (state.fills[0] == layerDepth) {
+            average(state, 0, prevLayerAvg.data());
+            int layer = 1;
+            while (layer < numLayers - 1) {
+                push(state, layer, prevLayerAvg.data());
+                if (state.fills[layer] < layerDepth) {
+                    break;
+                }
+                average(state, layer, prevLayerAvg.data());
+                layer++;
+            }
+            if (layer == numLayers - 1) {
+                push(state, numLayers - 1, prevLayerAvg.data());
+            }
+            for (int index = 0; index + 1 < layer; index++) {
+                clear(state, index);
+            }
+        }
+        average(state, numLayers - 1, state.remedian.next().data());
+        state.remedian.publish();
+    }
+
+    // Follows KernelDetector::detect and SnippetHistory::push
+    int16_t detect(int electrode, const int16_t* snippet) override {
+        Electrode& state = electrodes[electrode];
+        const std::vector<int16_t>& remedian = state.remedian.current();
+        size_t version = state.sequence.load(std::memory_order_relaxed);
+        state.sequence.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        int16_t* row = &state.rows[(state.count % history) * pixels];
+        int sum = 0;
+        for (int pixel = 0; pixel < pixels; pixel++) {
+            row[pixel] = abs(snippet[pixel] - remedian[pixel]);
+            sum += row[pixel];
+        }
+        int16_t rowAverage = sum / layerDepth;
+        state.prefix[(state.count + 1) % (history + 1)] = state.prefix[state.count % (history + 1)] + rowAverage;
+        state.count++;
+        state.sequence.store(version + 2, std::memory_order_release);
+        return weight(electrode, 0);
+    }
+
+    int16_t weight(int electrode, int offset) const override {
+        const Electrode& state = electrodes[electrode];
+        if (offset * 2 >= history) {
+            return 0;
+        }
+        long long newest = state.prefix[(state.count - offset) % (history + 1)];
+        long long oldest = state.prefix[(state.count - history + offset) % (history + 1)];
+        return (int)(newest - oldest) / layerDepth;
+    }
+
+    const int16_t* remedian(int electrode) const override {
+        return electrodes[electrode].remedian.current().data();
+    }
+
+    const int16_t* row(int electrode, int age) const override {
+        const Electrode& state = electrodes[electrode];
+        return &state.rows[((state.count - 1 - age) % history) * pixels];
+    }
+
+    void readRemedian(int electrode, int16_t* remedian) const override {
+        std::vector<int16_t> copy(pixels);
+        electrodes[electrode].remedian.read(copy);
+        std::copy(copy.begin(), copy.end(), remedian);
+    }
+
+    // Follows SnippetHistory::read
+    void readHistory(int electrode, int16_t* rows) const override {
+        const Electrode& state = electrodes[electrode];
+        while (true) {
+            size_t before = state.sequence.load(std::memory_order_acquire);
+            if (before % 2 == 0) {
+                for (int age = 0; age < history; age++) {
+                    std::copy_n(row(electrode, age), pixels, rows + age * pixels);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (state.sequence.load(std::memory_order_relaxed) == before) {
+                    return;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // Follows KernelDetector::saveState
+    void saveState(int electrode, uint8_t* bytes) const override {
+        const Electrode& state = electrodes[electrode];
+        StateWriter writer(bytes);
+        writer.write(state.remedian.current().data(), pixels);
+        for (int layer = 0; layer < numLayers; layer++) {
+            writer.write<uint32_t>(state.heads[layer]);
+            writer.write<uint32_t>(state.fills[layer]);
+            writer.write(&state.values[(size_t)layer * layerDepth * pixels], (size_t)layerDepth * pixels);
+            writer.write(&state.sums[(size_t)layer * pixels], pixels);
+        }
+        for (int age = 0; age < history; age++) {
+            writer.write(row(electrode, age), pixels);
+        }
+        for (int age = 0; age <= history; age++) {
+            writer.write<int64_t>(state.prefix[(state.count - age) % (history + 1)]);
+        }
+    }
+
+    // Follows KernelDetector::loadState
+    void loadState(int electrode, const uint8_t* bytes) override {
+        Electrode& state = electrodes[electrode];
+        StateReader reader(bytes);
+        std::vector<int16_t> remedian(pixels);
+        reader.read(remedian.data(), pixels);
+        state.remedian.reset(remedian);
+        for (int layer = 0; layer < numLayers; layer++) {
+            state.heads[layer] = reader.read<uint32_t>() % layerDepth;
+            state.fills[layer] = std::min<uint32_t>(reader.read<uint32_t>(), layerDepth);
+            reader.read(&state.values[(size_t)layer * layerDepth * pixels], (size_t)layerDepth * pixels);
+            reader.read(&state.sums[(size_t)layer * pixels], pixels);
+        }
+        if (median) {
+            state.remedianRow = remedian;
+            state.deepestChanged = false;
+        }
+        state.count = history;
+        for (int age = 0; age < history; age++) {
+            reader.read(&state.rows[((state.count - 1 - age) % history) * pixels], pixels);
+        }
+        for (int age = 0; age <= history; age++) {
+            state.prefix[(state.count - age) % (history + 1)] = reader.read<int64_t>();
+        }
+    }
+
+    bool specialized() const override {
+        return false;
+    }
+
+private:
+    struct Electrode {
+        std::vector<int16_t> values;  // [layer][slot][pixel]
+        std::vector<int32_t> sums;  // [layer][pixel]
+        std::vector<int> heads;
+        std::vector<int> fills;
+        Published<std::vector<int16_t>> remedian;
+        std::vector<int16_t> rows;  // [slot][pixel]
+        std::vector<long long> prefix;
+        size_t count;
+        std::atomic<size_t> sequence{ 0 };  // Twice the # of snippets pushed, plus one while one is being pushed
+        std::vector<int16_t> prevLayerAvg;  // Scratch row, kept with the electrode since electrodes are updated on different lanes
+        std::vector<int16_t> sorted;  // Scratch copy of a layer being sorted for its median, [slot][pixel] with sortedStride per slot
+        std::vector<int16_t> remedianRow;  // Median of the deepest layer
+        bool deepestChanged = false;
+    };
+
+    void push(Electrode& state, int layer, const int16_t* row) {
+        if (layer == numLayers - 1) {
+            state.deepestChanged = true;
+        }
+        int16_t* slot = &state.values[((size_t)layer * layerDepth + state.heads[layer]) * pixels];
+        int32_t* sum = &state.sums[(size_t)layer * pixels];
+        bool full = state.fills[layer] == layerDepth;
+        for (int pixel = 0; pixel < pixels; pixel++) {
+            sum[pixel] += row[pixel] - (full ? slot[pixel] : 0);
+            slot[pixel] = row[pixel];
+        }
+        if (!full) {
+            state.fills[layer]++;
+        }
+        state.heads[layer] = (state.heads[layer] + 1) % layerDepth;
+    }
+
+    void average(const Electrode& state, int layer, int16_t* avg) const {
+        const int32_t* sum = &state.sums[(size_t)layer * pixels];
+        for (int pixel = 0; pixel < pixels; pixel++) {
+            avg[pixel] = sum[pixel] / layerDepth;
+        }
+    }
+
+    void clear(Electrode& state, int layer) {
+        std::fill_n(state.sums.begin() + (size_t)layer * pixels, pixels, 0);
+        state.heads[layer] = 0;
+        state.fills[layer] = 0;
+    }
+
+    // Follows RemedianEngine::updateMedian, median and deepestMedian
+    void updateMedian(Electrode& state, const int16_t* snippet) {
+        push(state, 0, snippet);
+        int layer = 0;
+        while (layer < numLayers - 1 && state.fills[layer] == layerDepth) {
+            layerMedian(state, layer, state.prevLayerAvg.data());
+            clear(state, layer);
+            layer++;
+            push(state, layer, state.prevLayerAvg.data());
+        }
+        if (state.deepestChanged) {
+            deepestMedian(state);
+            state.deepestChanged = false;
+        }
+        std::copy(state.remedianRow.begin(), state.remedianRow.end(), state.remedian.next().begin());
+        state.remedian.publish();
+    }
+
+    // Applies the network a block of pixels at a time, so each comparator is a fixed size loop which vectorizes like the kernel's
+    void layerMedian(Electrode& state, int layer, int16_t* row) {
+        int16_t* sorted = state.sorted.data();
+        for (int slot = 0; slot < layerDepth; slot++) {
+            std::copy_n(state.values.begin() + ((size_t)layer * layerDepth + slot) * pixels, pixels, sorted + (size_t)slot * sortedStride);
+        }
+        for (int block = 0; block < sortedStride; block += SORT_BLOCK) {
+            for (const std::pair<int, int>& comparator : network) {
+                int16_t* low = sorted + (size_t)comparator.first * sortedStride + block;
+                int16_t* high = sorted + (size_t)comparator.second * sortedStride + block;
+                std::array<int16_t, SORT_BLOCK> smaller;
+                std::array<int16_t, SORT_BLOCK> larger;
+                for (int pixel = 0; pixel < SORT_BLOCK; pixel++) {
+                    smaller[pixel] = std::min(low[pixel], high[pixel]);
+                    larger[pixel] = std::max(low[pixel], high[pixel]);
+                }
+                std::copy(smaller.begin(), smaller.end(), low);
+                std::copy(larger.begin(), larger.end(), high);
+            }
+        }
+        const int16_t* lower = sorted + (size_t)((layerDepth - 1) / 2) * sortedStride;
+        const int16_t* upper = sorted + (size_t)(layerDepth / 2) * sortedStride;
+        for (int pixel = 0; pixel < pixels; pixel++) {
+            row[pixel] = ((int32_t)lower[pixel] + upper[pixel]) / 2;
+        }
+    }
+
+    void deepestMedian(Electrode& state) {
+        int layer = numLayers - 1;
+        int fills = state.fills[layer];
+        if (fills == layerDepth) {
+            layerMedian(state, layer, state.remedianRow.data());
+            return;
+        }
+        std::vector<int16_t> column(layerDepth, 0);
+        for (int pixel = 0; pixel < pixels; pixel++) {
+            for (int slot = 0; slot < fills; slot++) {
+                column[slot] = state.values[((size_t)layer * layerDepth + slot) * pixels + pixel];
+            }
+            state.remedianRow[pixel] = fills == 0 ? 0 : partialMedian(column.data(), fills);
+        }
+    }
+
+    int pixels;
+    int history;
+    int layerDepth;
+    int numLayers;
+    bool median;  // Whether each layer passes on its median rather than its average
+    std::vector<std::pair<int, int>> network;  // Comparators finding the median of a layer
+    static const int SORT_BLOCK = 16;  // Pixels sorted together
+    int sortedStride;  // Pixels rounded up to whole blocks
+    std::vector<Electrode> electrodes;
+};
+
+typedef std::unique_ptr<Detector> (*DetectorFactory)(int electrodes, Background background);
+
+template <size_t RADIUS, size_t HISTORY, size_t LAYER_DEPTH, size_t NUM_LAYERS>
+std::unique_ptr<Detector> createKernel(int electrodes, Background background) {
+    if (background == MEDIAN_BACKGROUND) {
+        return std::unique_ptr<Detector>(new KernelDetector<RADIUS, HISTORY, LAYER_DEPTH, NUM_LAYERS, true>(electrodes));
+    }
+    return std::unique_ptr<Detector>(new KernelDetector<RADIUS, HISTORY, LAYER_DEPTH, NUM_LAYERS, false>(electrodes));
+}
+
+struct KernelEntry {
+    int width;
+    int snippetDepth;
+    int depth;
+    int layers;
+    DetectorFactory create;
+};
+
+// Parameters with a compiled detector, add an entry to support another layout at full speed
+static const KernelEntry KERNELS[] = {
+    { 15, 30, 10, 3, createKernel<15, 30, 10, 3> },
+    { 5, 30, 10, 3, createKernel<5, 30, 10, 3> },
+    { 7, 30, 10, 3, createKernel<7, 30, 10, 3> },
+    { 10, 30, 10, 3, createKernel<10, 30, 10, 3> },
+    { 20, 30, 10, 3, createKernel<20, 30, 10, 3> },
+    { 25, 30, 10, 3, createKernel<25, 30, 10, 3> },
+    { 31, 30, 10, 3, createKernel<31, 30, 10, 3> },
+    { 15, 20, 10, 3, createKernel<15, 20, 10, 3> },
+    { 15, 40, 10, 3, createKernel<15, 40, 10, 3> },
+    { 15, 30, 10, 4, createKernel<15, 30, 10, 4> },
+};
+
+// Creates the compiled detector matching the parameters, or the generic detector if there is none (or it was asked for)
+std::unique_ptr<Detector> createDetector(const DetectionParameters& parameters, int electrodes, bool generic) {
+    if (!generic) {
+        for (const KernelEntry& kernel : KERNELS) {
+            if (kernel.width == parameters.width && kernel.snippetDepth == parameters.snippetDepth && kernel.depth == parameters.depth
+                && kernel.layers == parameters.layers) {
+                return kernel.create(electrodes, parameters.background);
+            }
+        }
+    }
+    return std::unique_ptr<Detector>(new GenericDetector(electrodes, parameters));
+}
+
+// Reads the detection parameters from the optional arguments, returning false if they are out of range
+bool readParameters(DetectionParameters& parameters) {
+    parameters.width = std::stoi(getOption("width", std::to_string(WIDTH)));
+    parameters.snippetDepth = std::stoi(getOption("snippet-depth", std::to_string(SNIPPET_DEPTH)));
+    parameters.depth = std::stoi(getOption("depth", std::to_string(DEPTH)));
+    parameters.layers = std::stoi(getOption("layers", std::to_string(LAYERS)));
+    parameters.threshold = std::stoi(getOption("threshold", std::to_string(THRESHOLD)));
+    string background = getOption("background", "mean");
+
+    if (parameters.width < 1 || parameters.width > MAX_WIDTH) {
+        std::cerr << "width must be between 1 and " << MAX_WIDTH << endl;
+        return false;
+    }
+    if (parameters.snippetDepth < 1 || parameters.snippetDepth > MAX_SNIPPET_DEPTH) {
+        std::cerr << "snippet-depth must be between 1 and " << MAX_SNIPPET_DEPTH << endl;
+        return false;
+    }
+    if (parameters.depth < 1 || parameters.layers < 1) {
+        std::cerr << "depth and layers must be at least 1" << endl;
+        return false;
+    }
+    if (background == "mean" || background == "median") {
+        parameters.background = background == "median" ? MEDIAN_BACKGROUND : MEAN_BACKGROUND;
+    }
+    else {
+        std::cerr << "background must be mean or median" << endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+*  ==========================================================
+*  Particle Weight Calculation Function
+*  ==========================================================
+*  Calculates the 2D average of a snippet image, giving the weight of its electrode.
+*  The narrower windows used to tell apart several electrodes above the threshold are calculated right away,
+*  while the history still holds this frame's snippet.
+*/
+
+void detectParticle(SensorState& state, const Snippet& snippet, int electrode, int16_t* weights) {
+    // Subtracts the remedians, puts the snippet at the front of its history and takes the 2D average of the history
+    weights[0] = state.detector->detect(electrode, snippet.data());
+    if (abs(weights[0]) >= parameters.threshold) {
+        for (int offset = 1; offset < state.weightOffsets; offset++) {
+            weights[offset] = state.detector->weight(electrode, offset);
+        }
+    }
+}
+
+/*
+*  ==========================================================
+*  Actuator
+*  ==========================================================
+*  Sends the electrode of each detected particle to the Arduino.
+*  The device is opened once by a dedicated writer thread, which reconnects if it is lost.
+*  Detections are handed to the writer through a lock-free multi-producer queue, so the decision never waits on the device or on other streams.
+*  The device can also be a pseudo-terminal or FIFO standing in for the Arduino, to measure the latency without the hardware.
+*/
+
+struct ActuatorCommand {
+    unsigned char electrode;
+    int frame;
+    Timestamp arrival;  // When the packet which completed the frame arrived
+    Timestamp detected;  // When the particle decision was made
+};
+
+// A queue slot is ready to write once its sequence is one past its position, and free again once it is a lap ahead
+struct ActuatorSlot {
+    std::atomic<size_t> sequence{ 0 };
+    ActuatorCommand command;
+};
+
+class Actuator {
+public:
+    Actuator() {
+        for (size_t i = 0; i < ACTUATOR_QUEUE; i++) {
+            queue[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    void start(const string& devicePath, unsigned int baudRate, const string& logPath) {
+        path = devicePath;
+        baud = baudRate;
+        if (!logPath.empty()) {
+            log.open(logPath, std::ios::out | std::ios::trunc);
+            log << "frame,electrode,latency_us\n";
+        }
+        running = true;
+        writer = std::thread(&Actuator::run, this);
+    }
+
+    // Queues a command for the writer thread, returning false if the queue was full
+    // Streams deciding at the same time claim separate slots by advancing the tail, so none of them blocks
+    bool send(unsigned char electrode, int frame, Timestamp arrival) {
+        size_t tail = queueTail.load(std::memory_order_relaxed);
+        ActuatorSlot* slot;
+        while (true) {
+            slot = &queue[tail % ACTUATOR_QUEUE];
+            std::ptrdiff_t lap = (std::ptrdiff_t)(slot->sequence.load(std::memory_order_acquire) - tail);
+            if (lap == 0) {
+                if (queueTail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (lap < 0) {
+                // The slot still holds a command from the previous lap
+                dropped++;
+                return false;
+            }
+            else {
+                tail = queueTail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->command = { electrode, frame, arrival, std::chrono::steady_clock::now() };
+        slot->sequence.store(tail + 1, std::memory_order_seq_cst);
+
+        // Only wakes the writer through the condition variable if it went to sleep
+        if (sleeping.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            wake.notify_one();
+        }
+        return true;
+    }
+
+    // Writes every queued command, then closes the device
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            running = false;
+        }
+        wake.notify_one();
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+
+    void report() {
+        cout << "Actuator: " << written << " commands written";
+        if (written > 0) {
+            cout << ", latency mean " << totalLatency / written << "us, max " << maxLatency << "us";
+        }
+        cout << ", " << dropped << " dropped, " << connectAttempts << " connection attempts" << endl;
+    }
+
+private:
+    static const size_t ACTUATOR_QUEUE = 256;  // Max # of commands waiting to be written
+    static const int SPIN_LIMIT = 1000;  // # of empty checks before the writer goes to sleep
+
+    void run() {
+        int spins = 0;
+        while (true) {
+            ActuatorSlot& slot = queue[queueHead % ACTUATOR_QUEUE];
+            if (slot.sequence.load(std::memory_order_acquire) != queueHead + 1) {
+                if (!running) {
+                    break;
+                }
+                // Spins briefly for low latency, then sleeps until a command is sent
+                if (++spins < SPIN_LIMIT) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                sleeping.store(true, std::memory_order_seq_cst);
+                if (slot.sequence.load(std::memory_order_seq_cst) != queueHead + 1 && running) {
+                    wake.wait_for(lock, std::chrono::milliseconds(100));
+                }
+                sleeping.store(false, std::memory_order_relaxed);
+                spins = 0;
+                continue;
+            }
+            spins = 0;
+
+            ActuatorCommand command = slot.command;
+            slot.sequence.store(queueHead + ACTUATOR_QUEUE, std::memory_order_release);
+            queueHead++;
+            write(command);
+        }
+        close();
+    }
+
+    // Opens the device, configuring the baud rate if it is a serial port
+    // Existing paths which aren't serial ports (such as a FIFO) are written to as a plain file
+    bool connect() {
+        auto now = std::chrono::steady_clock::now();
+        if (now < nextAttempt) {
+            return false;
+        }
+        nextAttempt = now + RECONNECT_DELAY;
+        connectAttempts++;
+
+        boost::system::error_code error;
+        port.open(path, error);
+        if (!error) {
+            port.set_option(serial_port_base::baud_rate(baud), error);
+            if (!error) {
+                return true;
+            }
+            port.close(error);
+        }
+
+        file = std::fopen(path.c_str(), "r+b");
+        if (file != nullptr) {
+            std::setvbuf(file, nullptr, _IONBF, 0);
+            std::fseek(file, 0, SEEK_END);
+            return true;
+        }
+        if (!warned) {
+            std::cerr << "Actuator: could not open " << path << ", retrying" << endl;
+            warned = true;
+        }
+        return false;
+    }
+
+    void close() {
+        boost::system::error_code error;
+        if (port.is_open()) {
+            port.close(error);
+        }
+        if (file != nullptr) {
+            std::fclose(file);
+            file = nullptr;
+        }
+    }
+
+    void write(const ActuatorCommand& command) {
+        if (!port.is_open() && file == nullptr && !connect()) {
+            dropped++;
+            return;
+        }
+
+        // Writes the electrode byte, closing the device so it is reopened if the write fails
+        bool success;
+        if (port.is_open()) {
+            boost::system::error_code error;
+            boost::asio::write(port, buffer(&command.electrode, 1), error);
+            success = !error;
+        }
+        else {
+            success = std::fwrite(&command.electrode, 1, 1, file) == 1;
+        }
+        if (!success) {
+            std::cerr << "Actuator: lost " << path << ", reconnecting" << endl;
+            close();
+            dropped++;
+            return;
+        }
+        warned = false;
+
+        // Records the time from the particle decision to the byte being written
+        Timestamp now = std::chrono::steady_clock::now();
+        statistics.record(ACTUATOR_STAGE, command.detected, now);
+        statistics.record(TOTAL_STAGE, command.arrival, now);
+        long long latency = std::chrono::duration_cast<std::chrono::microseconds>(now - command.detected).count();
+        written++;
+        totalLatency += latency;
+        maxLatency = std::max(maxLatency, latency);
+        if (log.is_open()) {
+            log << command.frame << "," << (int)command.electrode << "," << latency << "\n";
+        }
+    }
+
+    const std::chrono::seconds RECONNECT_DELAY = std::chrono::seconds(1);
+
+    string path;
+    unsigned int baud = 9600;
+    boost::asio::io_context io;
+    serial_port port{ io };
+    std::FILE* file = nullptr;
+    std::ofstream log;  // Detection to write latency of every command
+    std::chrono::steady_clock::time_point nextAttempt;
+    bool warned = false;
+
+    std::array<ActuatorSlot, ACTUATOR_QUEUE> queue;
+    size_t queueHead = 0;  // Next command to write, only used by the writer
+    std::atomic<size_t> queueTail{ 0 };  // Next slot to claim, advanced by every producer
+    std::atomic<bool> sleeping{ false };
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::atomic<bool> running{ false };
+    std::thread writer;
+
+    std::atomic<long long> dropped{ 0 };
+    long long written = 0;
+    long long connectAttempts = 0;
+    long long totalLatency = 0;
+    long long maxLatency = 0;
+};
+
+Actuator actuator;
+
+/*
+*  ==========================================================
+*  Particle Tracker
+*  ==========================================================
+*  Follows each particle from electrode to electrode with --track, so the actuator command is sent before the particle arrives
+*  instead of once its snippets were averaged at the electrode.
+*  A particle arrives at an electrode in the first frame that electrode's weight passes the threshold, and an arrival joins the track
+*  expected at that electrode, or a track which just arrived at the electrode next to it.
+*  Each track keeps its location and velocity with an alpha-beta filter over its arrivals, and predicts the frame it arrives
+*  at the next electrode in its direction. The command for that electrode is sent --track-lead frames before the prediction,
+*  and the detections at that electrode are covered by it until its weight drops below the threshold, instead of sending a command each frame.
+*  A stream is tracked by one thread at a time, in the order its frames are decided; a frame decided after a later one is not tracked.
+*/
+
+// Prediction error and lead of the tracker since it started, for the replay report and the benchmark
+struct TrackerSummary {
+    int lead;  // # of frames before the predicted arrival each command is sent
+    long long tracks;  // # of particles seen arriving at an electrode without being expected there
+    long long predictions;  // # of arrivals predicted
+    long long ahead;  // # of predicted arrivals whose command was sent ahead of the particle
+    long long late;  // # of predicted arrivals before their command was due
+    long long missed;  // # of commands sent for a particle which never arrived
+    long long covered;  // # of detections covered by a command sent ahead
+    double meanError;  // Mean absolute difference between the predicted and actual arrival, in frames
+    double maxError;
+    double meanLeadFrames;  // Mean # of frames a command was sent ahead of the arrival
+    double meanLeadMicroseconds;  // Mean time a command was sent ahead of the arrival's decision
+};
+
+class ParticleTracker {
+public:
+    void start(int leadFrames, int gapFrames) {
+        lead = leadFrames;
+        gap = gapFrames;
+        active = true;
+    }
+
+    bool enabled() const {
+        return active;
+    }
+
+    // Follows the particles arriving in a decided frame and sends the commands which are due
+    // Returns whether the detection at electrode is covered by a command already sent ahead of the particle
+    bool update(SensorState& state, int frame, const int16_t* weights, int electrode, Timestamp arrival) {
+        std::lock_guard<std::mutex> lock(state.trackMutex);
+        if (state.trackedFrame >= 0 && frame <= state.trackedFrame) {
+            return covers(state, electrode);
+        }
+        state.trackedFrame = frame;
+
+        Timestamp now = std::chrono::steady_clock::now();
+        for (int index = 0; index < state.numElectrodes; index++) {
+            bool above = abs(weights[index * state.weightOffsets]) >= parameters.threshold;
+            if (above && !state.aboveThreshold[index]) {
+                arrive(state, index, frame, now);
+            }
+            else if (!above) {
+                state.covered[index] = false;
+            }
+            state.aboveThreshold[index] = above;
+        }
+
+        for (size_t index = 0; index < state.tracks.size();) {
+            Track& track = state.tracks[index];
+            // Ends a track once it can't arrive anywhere else
+            if (frame - track.frame > gap) {
+                if (track.armed) {
+                    std::lock_guard<std::mutex> summaryLock(summaryMutex);
+                    summary.missed++;
+                }
+                state.tracks.erase(state.tracks.begin() + index);
+                continue;
+            }
+            // Sends the command for the predicted electrode once it is due
+            if (track.predicted >= 0 && !track.armed && std::isfinite(track.predictedFrame) && frame >= track.predictedFrame - lead) {
+                actuator.send(track.predicted, frame, arrival);
+                track.armed = true;
+                track.armedFrame = frame;
+                track.armedTime = now;
+            }
+            index++;
+        }
+        return covers(state, electrode);
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(summaryMutex);
+        summary = {};
+        errorTotal = 0;
+        leadFramesTotal = 0;
+        leadTotal = 0;
+    }
+
+    TrackerSummary summarize() {
+        std::lock_guard<std::mutex> lock(summaryMutex);
+        TrackerSummary result = summary;
+        result.lead = lead;
+        if (result.predictions > 0) {
+            result.meanError = errorTotal / result.predictions;
+        }
+        if (result.ahead > 0) {
+            result.meanLeadFrames = (double)leadFramesTotal / result.ahead;
+            result.meanLeadMicroseconds = leadTotal / result.ahead;
+        }
+        return result;
+    }
+
+    void report() {
+        if (!active) {
+            return;
+        }
+        TrackerSummary result = summarize();
+        cout << "Tracker: " << result.tracks << " particles, " << result.predictions << " arrivals predicted with a mean error of "
+            << result.meanError << " frames (max " << result.maxError << "), " << result.ahead << " commands sent ahead by "
+            << result.meanLeadFrames << " frames (" << result.meanLeadMicroseconds << "us) on average, " << result.late << " late, "
+            << result.missed << " missed, " << result.covered << " detections covered" << endl;
+    }
+
+private:
+    static constexpr double ALPHA = 0.5;  // Share of an arrival's location error added to the track's location
+    static constexpr double BETA = 0.3;  // Share of an arrival's location error added to the track's velocity, per frame
+    static const size_t MAX_TRACKS = 32;  // # of particles followed at once in a stream
+
+    // Updates the track expected at an electrode, or starts a new one
+    void arrive(SensorState& state, int electrode, int frame, Timestamp now) {
+        int location = state.electrodeLocations[electrode];
+        Track* best = nullptr;
+        double bestDistance = 0;
+        bool repeated = false;
+        for (Track& track : state.tracks) {
+            // The weight dropped and passed the threshold again while the particle is still in the electrode's snippet history
+            if (track.electrode == electrode && frame - track.frame <= parameters.snippetDepth) {
+                repeated = true;
+                continue;
+            }
+            // A particle passing the threshold at the next electrode in the same frame is part of the same arrival
+            if (frame <= track.frame) {
+                if (track.predicted == electrode
+                    || nextElectrode(state, track.electrode, location - state.electrodeLocations[track.electrode]) == electrode) {
+                    repeated = true;
+                }
+                continue;
+            }
+            double distance;
+            if (track.predicted == electrode) {
+                distance = std::abs(frame - track.predictedFrame);
+            }
+            else if (track.arrivals == 1 && nextElectrode(state, track.electrode, location - state.electrodeLocations[track.electrode]) == electrode) {
+                distance = frame - track.frame;
+            }
+            else {
+                continue;
+            }
+            if (best == nullptr || distance < bestDistance) {
+                best = &track;
+                bestDistance = distance;
+            }
+        }
+
+        if (best == nullptr && repeated) {
+            return;
+        }
+        if (best == nullptr) {
+            if (state.tracks.size() == MAX_TRACKS) {
+                state.tracks.erase(state.tracks.begin());
+            }
+            Track track;
+            track.electrode = electrode;
+            track.frame = frame;
+            track.arrivals = 1;
+            track.position = location;
+            state.tracks.push_back(track);
+            std::lock_guard<std::mutex> lock(summaryMutex);
+            summary.tracks++;
+            return;
+        }
+
+        Track& track = *best;
+        if (track.predicted == electrode) {
+            std::lock_guard<std::mutex> lock(summaryMutex);
+            double error = std::abs(frame - track.predictedFrame);
+            summary.predictions++;
+            summary.maxError = std::max(summary.maxError, error);
+            errorTotal += error;
+            if (track.armed) {
+                summary.ahead++;
+                leadFramesTotal += frame - track.armedFrame;
+                leadTotal += std::chrono::duration<double, std::micro>(now - track.armedTime).count();
+                state.covered[electrode] = true;
+            }
+            else {
+                summary.late++;
+            }
+        }
+
+        // Alpha-beta filter of the location and velocity, which the second arrival starts
+        int frames = frame - track.frame;
+        if (frames <= 0) {
+            return;
+        }
+        if (track.arrivals == 1) {
+            track.velocity = (location - track.position) / frames;
+            track.position = location;
+        }
+        else {
+            double predicted = track.position + track.velocity * frames;
+            double error = location - predicted;
+            track.position = predicted + ALPHA * error;
+            track.velocity += BETA * error / frames;
+        }
+        track.electrode = electrode;
+        track.frame = frame;
+        track.arrivals++;
+
+        // Predicts the arrival at the next electrode, if it is within the gap
+        track.predicted = -1;
+        track.armed = false;
+        int next = nextElectrode(state, electrode, track.velocity);
+        if (next >= 0) {
+            double arrivalFrame = frame + (state.electrodeLocations[next] - track.position) / track.velocity;
+            if (std::isfinite(arrivalFrame) && arrivalFrame - frame <= gap) {
+                track.predicted = next;
+                track.predictedFrame = arrivalFrame;
+            }
+        }
+    }
+
+    // Returns the electrode closest to an electrode in a direction along the sensor, or -1 if there is none
+    static int nextElectrode(const SensorState& state, int electrode, double direction) {
+        if (direction == 0) {
+            return -1;
+        }
+        int sign = direction > 0 ? 1 : -1;
+        int next = -1;
+        int nextDistance = 0;
+        for (int index = 0; index < state.numElectrodes; index++) {
+            int distance = (state.electrodeLocations[index] - state.electrodeLocations[electrode]) * sign;
+            if (distance > 0 && (next < 0 || distance < nextDistance)) {
+                next = index;
+                nextDistance = distance;
+            }
+        }
+        return next;
+    }
+
+    bool covers(const SensorState& state, int electrode) {
+        if (electrode < 0 || !state.covered[electrode]) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(summaryMutex);
+        summary.covered++;
+        return true;
+    }
+
+    bool active = false;
+    int lead = 5;  // # of frames before the predicted arrival the command is sent
+    int gap = 100;  // Most frames a particle takes from one electrode to the next
+
+    std::mutex summaryMutex;
+    TrackerSummary summary = {};
+    double errorTotal = 0;
+    long long leadFramesTotal = 0;
+    double leadTotal = 0;
+};
+
+ParticleTracker tracker;
+
+/*
+*  ==========================================================
+*  Particle Decision Function
+*  ==========================================================
+*  Determines if a particle is detected once all electrodes had their weight calculated.
+*  Activates the electrode the particle is in line with.
+*/
+
+// Chooses the electrode a particle is in line with from the weights of every electrode in a frame, returning -1 if there is no particle
+// Each electrode has offsets weights, where the narrower windows are only needed for electrodes whose full window passed the threshold
+// similar is set if more than one electrode passed the threshold
+int chooseElectrode(const int16_t* weights, int numElectrodes, int offsets, int threshold, bool& similar) {
+    // Determines which averages are above the threshold
+    std::vector<int> aboveThreshold;
+    for (int index = 0; index < numElectrodes; index++) {
+        if (abs(weights[index * offsets]) >= threshold) {
+            aboveThreshold.push_back(index);
+        }
+    }
+    similar = aboveThreshold.size() > 1;
+
+    // If there is no average above the threshold
+    if (aboveThreshold.empty()) {
+        return -1;
+    }
+    // If more than one average is above the threshold
+    if (aboveThreshold.size() > 1) {
+        // While there is still more than one average above the threshold
+        int offset = 1;
+        while (aboveThreshold.size() > 1 && offset < offsets) {
+            // Take the 2D average with a smaller window from the snippet matrix
+            std::vector<int> newAboveThreshold;
+            for (int electrode : aboveThreshold) {
+                // Save the electrode if its average is still above the threshold
+                if (abs(weights[electrode * offsets + offset]) >= threshold) {
+                    newAboveThreshold.push_back(electrode);
+                }
+            }
+            aboveThreshold = newAboveThreshold;
+            offset++;
+        }
+        // If there is still more than one average
+        if (aboveThreshold.size() > 1 || aboveThreshold.size() == 0) {
+            int16_t maxWeight = 0;
+            int maxWeightIndex = 0;
+            // Finds the electrode with the highest average
+            for (int index = 0; index < numElectrodes; index++) {
+                if (abs(weights[index * offsets]) > abs(maxWeight)) {
+                    maxWeight = weights[index * offsets];
+                    maxWeightIndex = index;
+                }
+            }
+            aboveThreshold = { maxWeightIndex };
+        }
+    }
+    return aboveThreshold[0];
+}
+
+void decideParticle(SensorState& state, int frame, const int16_t* weights, Timestamp arrival) {
+    statistics.count(DECISION_COUNTER);
+    bool similar;
+    int electrode = chooseElectrode(weights, state.numElectrodes, state.weightOffsets, parameters.threshold, similar);
+    bool covered = tracker.enabled() && tracker.update(state, frame, weights, electrode, arrival);
+    if (electrode >= 0) {
+        int16_t weight = weights[electrode * state.weightOffsets];
+        if(writeParticles) logParticle(state, electrode, frame, weight, similar);
+        logLocation(state, frame, electrode, weight);  // Saves the particle location
+        statistics.count(PARTICLE_COUNTER);
+        statistics.record(DECISION_STAGE, arrival);
+
+        // Sends the electrode that contains the particle to the Arduino, unless the tracker sent it ahead of the particle
+        if (!covered) {
+            actuator.send(electrode, frame, arrival);
+        }
+    }
+    else {
+        statistics.record(DECISION_STAGE, arrival);
+    }
+    if (telemetry.enabled()) {
+        telemetry.publishFrame(state, frame, weights, electrode, similar, arrival);
+    }
+}
+
+/*
+*  ==========================================================
+*  Frame Aggregation
+*  ==========================================================
+*  Collects the weights of every electrode of a frame from all of its segments, then makes exactly one decision for the frame.
+*  The decision is made once every snippet of the frame was weighed, so it doesn't depend on which lane finishes first.
+*  With --decision-deadline, a watchdog makes the decision of any frame still waiting after the deadline with the weights it has,
+*  so a late segment or a backed up lane never delays the actuator by more than the latency budget.
+*/
+
+FrameSlot& frameSlot(SensorState& state, int frame) {
+    return state.frames[(unsigned int)frame % FRAME_SLOTS];
+}
+
+// Makes the decision of a frame, with a weight of 0 for any electrode that wasn't weighed
+// Only the thread which released the last reference can read the weights in place, since no lane is still writing them
+void decideFrame(SensorState& state, FrameSlot& slot, bool complete) {
+    std::vector<int16_t> partialWeights;
+    const int16_t* weights = slot.weights.get();
+    int weighed = 0;
+    for (int electrode = 0; electrode < state.numElectrodes; electrode++) {
+        if (slot.weighed[electrode].load(std::memory_order_acquire)) {
+            weighed++;
+        }
+        else if (!complete && partialWeights.empty()) {
+            partialWeights.assign(state.numElectrodes * state.weightOffsets, 0);
+        }
+    }
+    if (weighed == 0 && complete) {
+        return;  // Every snippet of the frame was incomplete
+    }
+    if (!partialWeights.empty()) {
+        for (int electrode = 0; electrode < state.numElectrodes; electrode++) {
+            if (slot.weighed[electrode].load(std::memory_order_acquire)) {
+                std::copy_n(weights + electrode * state.weightOffsets, state.weightOffsets, partialWeights.begin() + electrode * state.weightOffsets);
+            }
+        }
+        weights = partialWeights.data();
+    }
+    decideParticle(state, slot.frame, weights, Timestamp(Timestamp::duration(slot.arrival.load(std::memory_order_relaxed))));
+}
+
+void releaseFrame(SensorState& state, FrameSlot& slot) {
+    if (slot.references.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (!slot.decided.exchange(true, std::memory_order_acq_rel)) {
+        decideFrame(state, slot, true);
+    }
+    slot.free.store(true, std::memory_order_release);
+}
+
+// Starts collecting a frame, waiting for the lanes to finish the frame which last used its slot
+void openFrame(SensorState& state, int frame, Timestamp arrival) {
+    FrameSlot& slot = frameSlot(state, frame);
+    if (!slot.free.load(std::memory_order_acquire)) {
+        state.slotWaits++;
+        while (!slot.free.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+    slot.free.store(false, std::memory_order_relaxed);
+    slot.decided.store(false, std::memory_order_relaxed);
+    slot.frame = frame;
+    slot.opened = arrival;
+    for (int electrode = 0; electrode < state.numElectrodes; electrode++) {
+        slot.weighed[electrode].store(false, std::memory_order_relaxed);
+        slot.weights[electrode * state.weightOffsets] = 0;
+    }
+    slot.references.store(1, std::memory_order_release);
+    state.frame = frame;
+    state.frameOpen = true;
+}
+
+// Releases the reader's reference once the frame can't get any more snippets
+void closeFrame(SensorState& state) {
+    if (state.frameOpen) {
+        state.frameOpen = false;
+        releaseFrame(state, frameSlot(state, state.frame));
+    }
+}
+
+// Makes the decision of a frame whose deadline passed, if it is still waiting on snippets
+void expireFrame(SensorState& state, FrameSlot& slot, Timestamp now, std::chrono::microseconds deadline) {
+    // Takes a reference, so the slot can't be reused while it is being read
+    int references = slot.references.load(std::memory_order_acquire);
+    do {
+        if (references == 0) {
+            return;
+        }
+    } while (!slot.references.compare_exchange_weak(references, references + 1, std::memory_order_acq_rel));
+
+    if (now - slot.opened >= deadline && !slot.decided.exchange(true, std::memory_order_acq_rel)) {
+        state.lateFrames++;
+        decideFrame(state, slot, false);
+    }
+    releaseFrame(state, slot);
+}
+
+std::mutex sensorStatesMutex;
+std::vector<std::unique_ptr<SensorState>> sensorStates;  // Every stream, kept until the program ends since queued snippets point to them
+
+// Checks every waiting frame of every stream twice per deadline
+class FrameWatchdog {
+public:
+    void start(std::chrono::microseconds deadline) {
+        this->deadline = deadline;
+        running = true;
+        thread = std::thread(&FrameWatchdog::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_one();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            wake.wait_for(lock, deadline / 2);
+            lock.unlock();
+            {
+                Timestamp now = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> statesLock(sensorStatesMutex);
+                for (const std::unique_ptr<SensorState>& state : sensorStates) {
+                    for (FrameSlot& slot : state->frames) {
+                        expireFrame(*state, slot, now, deadline);
+                    }
+                }
+            }
+            lock.lock();
+        }
+    }
+
+    std::chrono::microseconds deadline{ 0 };
+    bool running = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+};
+
+FrameWatchdog watchdog;
+
+/*
+*  ==========================================================
+*  Background Checkpoint
+*  ==========================================================
+*  Saves the background state of every electrode to a file with --checkpoint, so a restarted program detects particles
+*  from its first frame instead of waiting for the remedian to fill up again.
+*  Every --checkpoint-frames frames, each lane saves the state of its electrodes right after updating them, so a state is never half updated.
+*  A background thread writes the latest saved states every --checkpoint-seconds, to a temporary file which then replaces the checkpoint,
+*  and the exact final state is written once the lanes have stopped.
+*  On startup the previous checkpoint is memory mapped and checked against the detection parameters and a checksum.
+*  Each new stream takes the state of the first saved stream with the same sensor and electrode layout,
+*  and saved streams which haven't reconnected yet are kept in the next checkpoint.
+*/
+
+static const uint32_t CHECKPOINT_MAGIC = 0x4b434450;  // "PDCK"
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+// Followed by each stream: its sensor, electrode count and electrode locations as int32s, then the state of each electrode
+struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t width;
+    int32_t snippetDepth;
+    int32_t depth;
+    int32_t layers;
+    int32_t background;
+    uint32_t stateBytes;  // Size of each electrode's state
+    uint32_t streams;
+    uint32_t reserved;
+    uint64_t checksum;  // FNV-1a hash of everything after the header
+};
+
+uint64_t checksum(const uint8_t* bytes, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t index = 0; index < size; index++) {
+        hash = (hash ^ bytes[index]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+class Checkpoint {
+public:
+    // Reads the previous checkpoint at the path, then starts writing a new one every interval
+    void start(const string& path, int frames, int seconds) {
+        this->path = path;
+        this->frames = frames;
+        this->interval = std::chrono::seconds(seconds);
+        load();
+        running = true;
+        thread = std::thread(&Checkpoint::run, this);
+    }
+
+    // Writes the final state, once no lane updates any electrode
+    void stop() {
+        if (!thread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_one();
+        thread.join();
+        write(true);
+    }
+
+    bool enabled() const {
+        return frames > 0;
+    }
+
+    // Whether the lanes save the state of each electrode after processing the frame
+    bool saves(int frame) const {
+        return frames > 0 && frame % frames == 0;
+    }
+
+    // Restores a new stream from the first unused saved stream with its sensor and layout, then saves its starting state
+    // Called before any of the stream's snippets are processed, with sensorStatesMutex held
+    bool restore(SensorState& state) {
+        if (!enabled()) {
+            return false;
+        }
+        size_t stateBytes = backgroundStateBytes(parameters);
+        bool restored = false;
+        for (SavedStream& saved : savedStreams) {
+            if (!saved.used && saved.sensor == state.sensor && saved.locations == state.electrodeLocations) {
+                for (int electrode = 0; electrode < state.numElectrodes; electrode++) {
+                    state.detector->loadState(electrode, &saved.states[electrode * stateBytes]);
+                }
+                saved.used = true;
+                restored = true;
+                restoredStreams++;
+                break;
+            }
+        }
+        state.checkpoints.reset(new Published<std::vector<uint8_t>>[state.numElectrodes]);
+        std::vector<uint8_t> bytes(stateBytes);
+        for (int electrode = 0; electrode < state.numElectrodes; electrode++) {
+            state.detector->saveState(electrode, bytes.data());
+            state.checkpoints[electrode].reset(bytes);
+        }
+        return restored;
+    }
+
+    void report() {
+        if (enabled()) {
+            cout << "Checkpoint: " << writes << " writes to " << path << ", " << restoredStreams << " streams restored" << endl;
+        }
+    }
+
+private:
+    // A stream of the previous checkpoint
+    struct SavedStream {
+        int sensor;
+        std::vector<int> locations;
+        std::vector<uint8_t> states;  // State of each electrode, in electrode order
+        bool used = false;  // Whether a stream of this run was restored from it
+    };
+
+    // Maps the previous checkpoint and keeps a copy of its streams, if it matches the parameters
+    void load() {
+        if (!std::ifstream(path, std::ios::binary)) {
+            cout << "Checkpoint: no checkpoint at " << path << " yet" << endl;
+            return;
+        }
+        boost::interprocess::file_mapping mapping(path.c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+        const uint8_t* data = static_cast<const uint8_t*>(region.get_address());
+        size_t size = region.get_size();
+
+        CheckpointHeader header;
+        string problem;
+        if (size < sizeof(header)) {
+            problem = "too short";
+        }
+        else {
+            std::memcpy(&header, data, sizeof(header));
+            if (header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION) {
+                problem = "not a checkpoint of this version";
+            }
+            else if (header.width != parameters.width || header.snippetDepth != parameters.snippetDepth || header.depth != parameters.depth
+                || header.layers != parameters.layers || header.background != parameters.background
+                || header.stateBytes != backgroundStateBytes(parameters)) {
+                problem = "saved with other detection parameters";
+            }
+            else if (header.checksum != checksum(data + sizeof(header), size - sizeof(header))) {
+                problem = "checksum mismatch";
+            }
+        }
+
+        // Reads each stream, checking it fits in the file
+        std::vector<SavedStream> streams;
+        size_t offset = sizeof(header);
+        for (uint32_t stream = 0; problem.empty() && stream < header.streams; stream++) {
+            int32_t fields[2];
+            if (size - offset < sizeof(fields)) {
+                problem = "truncated";
+                break;
+            }
+            std::memcpy(fields, data + offset, sizeof(fields));
+            offset += sizeof(fields);
+            size_t electrodes = (uint32_t)fields[1];
+            if ((size - offset) / (sizeof(int32_t) + header.stateBytes) < electrodes) {
+                problem = "truncated";
+                break;
+            }
+            SavedStream saved;
+            saved.sensor = fields[0];
+            std::vector<int32_t> locations(electrodes);
+            std::memcpy(locations.data(), data + offset, electrodes * sizeof(int32_t));
+            offset += electrodes * sizeof(int32_t);
+            saved.locations.assign(locations.begin(), locations.end());
+            saved.states.assign(data + offset, data + offset + electrodes * header.stateBytes);
+            offset += electrodes * header.stateBytes;
+            streams.push_back(std::move(saved));
+        }
+        if (problem.empty() && offset != size) {
+            problem = "unexpected data after the last stream";
+        }
+
+        if (!problem.empty()) {
+            std::cerr << "Checkpoint " << path << " not used: " << problem << endl;
+            return;
+        }
+        savedStreams = std::move(streams);
+        cout << "Checkpoint: " << savedStreams.size() << " saved streams in " << path << endl;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            wake.wait_for(lock, interval);
+            if (!running) {
+                break;
+            }
+            lock.unlock();
+            write(false);
+            lock.lock();
+        }
+    }
+
+    // Writes every stream, from the states the lanes saved or straight from the detectors once they have stopped
+    void write(bool final) {
+        size_t stateBytes = backgroundStateBytes(parameters);
+        std::vector<uint8_t> bytes(sizeof(CheckpointHeader));
+        auto append = [&](const void* values, size_t size) {
+            const uint8_t* begin = static_cast<const uint8_t*>(values);
+            bytes.insert(bytes.end(), begin, begin + size);
+        };
+        auto appendStream = [&](int sensor, const std::vector<int>& locations) {
+            int32_t fields[2] = { sensor, (int32_t)locations.size() };
+            append(fields, sizeof(fields));
+            std::vector<int32_t> saved(locations.begin(), locations.end());
+            append(saved.data(), saved.size() * sizeof(int32_t));
+        };
+
+        uint32_t streams = 0;
+        std::vector<uint8_t> state(stateBytes);
+        {
+            std::lock_guard<std::mutex> lock(sensorStatesMutex);
+            for (const std::unique_ptr<SensorState>& sensorState : sensorStates) {
+                appendStream(sensorState->sensor, sensorState->electrodeLocations);
+                for (int electrode = 0; electrode < sensorState->numElectrodes; electrode++) {
+                    if (final) {
+                        sensorState->detector->saveState(electrode, state.data());
+                    }
+                    else {
+                        sensorState->checkpoints[electrode].read(state);
+                    }
+                    append(state.data(), stateBytes);
+                }
+                streams++;
+            }
+            for (const SavedStream& saved : savedStreams) {
+                if (!saved.used) {
+                    appendStream(saved.sensor, saved.locations);
+                    append(saved.states.data(), saved.states.size());
+                    streams++;
+                }
+            }
+        }
+
+        CheckpointHeader header = { CHECKPOINT_MAGIC, CHECKPOINT_VERSION, parameters.width, parameters.snippetDepth, parameters.depth,
+            parameters.layers, parameters.background, (uint32_t)stateBytes, streams, 0, checksum(bytes.data() + sizeof(header), bytes.size() - sizeof(header)) };
+        std::memcpy(bytes.data(), &header, sizeof(header));
+
+        // Replaces the checkpoint in one step, so a crash while writing leaves the previous one
+        string temporary = path + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            if (!file) {
+                std::cerr << "Could not write checkpoint " << temporary << endl;
+                return;
+            }
+        }
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::cerr << "Could not replace checkpoint " << path << endl;
+            return;
+        }
+        writes++;
+    }
+
+    string path;
+    int frames = 0;  // Frames between the states saved by the lanes, or 0 without --checkpoint
+    std::chrono::seconds interval{ 0 };
+    std::vector<SavedStream> savedStreams;
+    long long writes = 0;
+    long long restoredStreams = 0;
+    bool running = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+};
+
+Checkpoint checkpoint;
+
+// Saves an electrode's state for the checkpoint, on the lane which just updated it
+void saveCheckpoint(SensorState& state, int electrode) {
+    Published<std::vector<uint8_t>>& saved = state.checkpoints[electrode];
+    state.detector->saveState(electrode, saved.next().data());
+    saved.publish();
+}
+
+/*
+*  ==========================================================
+*  Remedian Function
+*  ==========================================================
+*  Updates the remedian of every pixel in the snippet.
+*/
+
+void findRemedian(SensorState& state, const Snippet& snippet, int electrode) {
+    // Finds the remedian for each pixel in the snippet
+    state.detector->updateRemedian(electrode, snippet.data());
+
+    if (writeRemedians) {
+        logRemedians(state, electrode);
+    }
+}
+
+/*
+*  ==========================================================
+*  Worker Pool
+*  ==========================================================
+*  Persistent threads which process snippets, with one lane for each shard of electrodes.
+*  An electrode is always sent to the same lane, so its remedian and detection run in order.
+*  Each snippet's weights are written to its frame's slot, and whichever thread finishes the frame's last snippet makes the decision.
+*/
+
+struct SnippetJob {
+    SensorState* state;
+    Snippet snippet;
+    int frame;
+    int segment;
+    int led_config;
+    int electrode;
+    FrameSlot* slot;  // Holds a reference to the frame's slot until the snippet is weighed
+    Timestamp arrival;  // When the packet arrived
+    bool checkpoint;  // Whether to save the electrode's state for the checkpoint once it is updated
+};
+
+class Lane {
+public:
+    Lane() : queue(QUEUE_DEPTH) {}
+
+    void start() {
+        worker = std::thread(&Lane::run, this);
+    }
+
+    // Adds a snippet to the queue, blocking while the queue is full
+    void push(SnippetJob&& job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (count == QUEUE_DEPTH) {
+            stalls++;
+            notFull.wait(lock, [this] { return count < QUEUE_DEPTH; });
+        }
+        queue[(head + count) % QUEUE_DEPTH] = std::move(job);
+        count++;
+        if (count > maxDepth) {
+            maxDepth = count;
+        }
+        notEmpty.notify_one();
+    }
+
+    // Blocks until every queued snippet has been processed
+    void waitIdle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return count == 0 && !busy; });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        notEmpty.notify_one();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    int maxDepth = 0;  // Deepest the queue has been
+    long long stalls = 0;  // # of times the reader waited on a full queue
+    long long processed = 0;  // # of snippets processed
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            notEmpty.wait(lock, [this] { return count > 0 || stopping; });
+            if (count == 0) {
+                return;
+            }
+            SnippetJob job = std::move(queue[head]);
+            head = (head + 1) % QUEUE_DEPTH;
+            count--;
+            busy = true;
+            notFull.notify_one();
+            lock.unlock();
+
+            findRemedian(*job.state, job.snippet, job.electrode);
+            statistics.record(REMEDIAN_STAGE, job.arrival);
+            // Writes snippet data if needed
+            if (writeSnippets) {
+                logSnippet(*job.state, job.snippet, job.frame, job.segment, job.led_config, job.electrode);
+            }
+            detectParticle(*job.state, job.snippet, job.electrode, &job.slot->weights[job.electrode * job.state->weightOffsets]);
+            if (job.checkpoint) {
+                saveCheckpoint(*job.state, job.electrode);
+            }
+            job.slot->weighed[job.electrode].store(true, std::memory_order_release);
+            statistics.record(DETECTION_STAGE, job.arrival);
+            statistics.count(SNIPPET_COUNTER);
+            releaseFrame(*job.state, *job.slot);
+
+            lock.lock();
+            busy = false;
+            processed++;
+            if (count == 0) {
+                idle.notify_all();
+            }
+        }
+    }
+
+    std::vector<SnippetJob> queue;
+    int head = 0;
+    int count = 0;
+    bool busy = false;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::condition_variable idle;
+    std::thread worker;
+};
+
+std::vector<std::unique_ptr<Lane>> lanes;
+
+// Starts one lane per shard of electrodes
+void startPool(int requestedLanes) {
+    numLanes = std::max(1, requestedLanes);
+    for (int lane = 0; lane < numLanes; lane++) {
+        lanes.push_back(std::make_unique<Lane>());
+        lanes.back()->start();
+    }
+}
+
+// Waits for all queued snippets to finish, then stops every lane
+void stopPool() {
+    for (std::unique_ptr<Lane>& lane : lanes) {
+        lane->waitIdle();
+        lane->stop();
+    }
+}
+
+// Prints how busy each lane has been
+void reportPool() {
+    for (int lane = 0; lane < numLanes; lane++) {
+        cout << "Lane " << lane << ": " << lanes[lane]->processed << " snippets, max queue depth "
+            << lanes[lane]->maxDepth << "/" << QUEUE_DEPTH << ", " << lanes[lane]->stalls << " stalls" << endl;
+    }
+}
+
+/*
+*  ==========================================================
+*  Ethernet Read Function
+*  ==========================================================
+*  Reads data over ethernet into a preallocated ring of packet slots.
+*  A reader thread reads as many bytes as the socket has ready with each call, so several packets arrive per call,
+*  and a packet split across two reads is simply completed by the next one.
+*  The ring holds a whole number of packets, so a packet never wraps around its end and can be handed out in place.
+*  The data is stored as uint8_t, the standard type for unsigned byte data.
+*/
+
+class PacketRing {
+public:
+    PacketRing() : data(new uint8_t[RING_BYTES]), arrivals(new Timestamp[RING_PACKETS]) {}
+
+    void start(tcp::socket& socket) {
+        reader = std::thread(&PacketRing::run, this, std::ref(socket));
+    }
+
+    // Waits for the next whole packet, returning a view of its slot or nullptr once the connection closed
+    // The slot stays valid until release() is called
+    const std::array<uint8_t, PACKET_LENGTH>* next() {
+        if (writtenBytes.load(std::memory_order_acquire) / PACKET_LENGTH == consumed) {
+            std::unique_lock<std::mutex> lock(mutex);
+            available.wait(lock, [this] { return writtenBytes.load(std::memory_order_acquire) / PACKET_LENGTH > consumed || closed; });
+            if (writtenBytes.load(std::memory_order_acquire) / PACKET_LENGTH == consumed) {
+                return nullptr;
+            }
+        }
+        return reinterpret_cast<const std::array<uint8_t, PACKET_LENGTH>*>(data.get() + (consumed % RING_PACKETS) * PACKET_LENGTH);
+    }
+
+    // Time at which the packet returned by next() finished arriving
+    Timestamp arrival() const {
+        return arrivals[consumed % RING_PACKETS];
+    }
+
+    // Frees the slot of the packet returned by next()
+    void release() {
+        consumed++;
+        releasedPackets.store(consumed, std::memory_order_release);
+        if (readerWaiting.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            space.notify_one();
+        }
+    }
+
+    void stop() {
+        if (reader.joinable()) {
+            reader.join();
+        }
+    }
+
+    void report() {
+        double seconds = std::chrono::duration<double>(lastRead - firstRead).count();
+        uint64_t bytes = writtenBytes.load();
+        cout << "Ingest: " << bytes << " bytes in " << reads << " reads";
+        if (seconds > 0) {
+            cout << ", " << bytes / seconds << " bytes/s";
+        }
+        if (reads > 0) {
+            cout << ", " << (double)(bytes / PACKET_LENGTH) / reads << " packets/read, ring occupancy mean "
+                << (double)totalOccupancy / reads << " max " << maxOccupancy << "/" << RING_PACKETS;
+        }
+        cout << ", " << stalls << " stalls" << endl;
+    }
+
+private:
+    static const size_t RING_PACKETS = 4096;  // # of packet slots in the ring
+    static const size_t RING_BYTES = RING_PACKETS * PACKET_LENGTH;
+
+    void run(tcp::socket& socket) {
+        while (true) {
+            uint64_t written = writtenBytes.load(std::memory_order_relaxed);
+            uint64_t used = written - releasedPackets.load(std::memory_order_acquire) * PACKET_LENGTH;
+
+            // Waits for the processing thread to free a slot if the ring is full
+            if (used == RING_BYTES) {
+                stalls++;
+                std::unique_lock<std::mutex> lock(mutex);
+                readerWaiting.store(true, std::memory_order_seq_cst);
+                space.wait_for(lock, std::chrono::milliseconds(1), [&] {
+                    return written - releasedPackets.load(std::memory_order_acquire) * PACKET_LENGTH < RING_BYTES;
+                });
+                readerWaiting.store(false, std::memory_order_relaxed);
+                continue;
+            }
+
+            // Reads straight into the ring, up to its end or the oldest slot still in use
+            size_t position = written % RING_BYTES;
+            size_t contiguous = std::min<uint64_t>(RING_BYTES - used, RING_BYTES - position);
+            boost::system::error_code error;
+            size_t bytes = socket.read_some(boost::asio::buffer(data.get() + position, contiguous), error);
+            if (error) {
+                cout << "Connection closed: " << error.message() << endl;
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                available.notify_one();
+                return;
+            }
+
+            lastRead = std::chrono::steady_clock::now();
+            if (reads == 0) {
+                firstRead = lastRead;
+            }
+            reads++;
+            uint64_t occupancy = (written + bytes) / PACKET_LENGTH - releasedPackets.load(std::memory_order_relaxed);
+            totalOccupancy += occupancy;
+            maxOccupancy = std::max(maxOccupancy, occupancy);
+
+            // Stamps every packet completed by this read with its arrival time
+            for (uint64_t packet = written / PACKET_LENGTH; packet < (written + bytes) / PACKET_LENGTH; packet++) {
+                arrivals[packet % RING_PACKETS] = lastRead;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            writtenBytes.store(written + bytes, std::memory_order_release);
+            available.notify_one();
+        }
+    }
+
+    std::unique_ptr<uint8_t[]> data;
+    std::unique_ptr<Timestamp[]> arrivals;  // Arrival time of the packet in each slot
+    std::atomic<uint64_t> writtenBytes{ 0 };  // Total bytes read, only changed by the reader
+    std::atomic<uint64_t> releasedPackets{ 0 };  // Total packets released, only changed by the processing thread
+    uint64_t consumed = 0;  // Packets handed out by next(), only used by the processing thread
+    std::atomic<bool> readerWaiting{ false };
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable available;
+    std::condition_variable space;
+    std::thread reader;
+
+    // Statistics, only changed by the reader
+    long long reads = 0;
+    long long stalls = 0;  // # of times the ring was full
+    uint64_t totalOccupancy = 0;
+    uint64_t maxOccupancy = 0;
+    std::chrono::steady_clock::time_point firstRead;
+    std::chrono::steady_clock::time_point lastRead;
+};
+
+/*
+*  ==========================================================
+*  Electrode Routing
+*  ==========================================================
+*  Compiles the electrode locations into a table of which pixels each segment contributes to each snippet.
+*  A segment only visits the electrodes whose snippets it overlaps, instead of checking every electrode.
+*  Snippets which cross the edge of a segment are put together from consecutive segments of the same frame,
+*  and are processed once the segment holding their last pixels arrives.
+*  Each segment is decoded into its place in the stream's line, so a complete snippet is a single slice of the line.
+*  Pixels outside of the sensor are left as 0.
+*/
+
+// Decodes the pixels of a segment into the stream's line
+void decodeSegment(SensorState& state, const uint8_t* packet, int segment) {
+    decodePixels(packet, 0, SEGMENT_PIXELS, state.line.data() + MAX_WIDTH + (segment - 1) * SEGMENT_PIXELS);
+}
+
+// Copies an electrode's snippet out of the stream's line
+void readSnippet(const SensorState& state, int electrode, Snippet& snippet) {
+    std::copy_n(state.line.begin() + MAX_WIDTH + state.electrodeLocations[electrode] - parameters.width, parameters.snippetPixels(), snippet.begin());
+}
+
+void buildRoutes(SensorState& state) {
+    for (int electrode = 0; electrode < state.numElectrodes; electrode++) {
+        int location = state.electrodeLocations[electrode];
+        int firstPixel = location - parameters.width;
+        int lastPixel = location + parameters.width;
+
+        // Electrodes centered outside of the sensor are never processed
+        if (location < 0 || location >= SEGMENTS_PER_FRAME * SEGMENT_PIXELS) {
+            std::cerr << "Electrode " << electrode << " of sensor " << state.sensor << " at pixel " << location << " is outside of the sensor" << endl;
+            continue;
+        }
+
+        // Splits the snippet at every segment edge it crosses
+        int firstSegment = std::max(firstPixel, 0) / SEGMENT_PIXELS;
+        int lastSegment = std::min(lastPixel, SEGMENTS_PER_FRAME * SEGMENT_PIXELS - 1) / SEGMENT_PIXELS;
+        for (int segment = firstSegment; segment <= lastSegment; segment++) {
+            int start = std::max(firstPixel, segment * SEGMENT_PIXELS);
+            int end = std::min(lastPixel, segment * SEGMENT_PIXELS + SEGMENT_PIXELS - 1);
+            state.routes[segment].push_back({ electrode, start - segment * SEGMENT_PIXELS, end - start + 1, segment == lastSegment });
+        }
+        state.partialSnippets[electrode].totalParts = lastSegment - firstSegment + 1;
+    }
+
+    // The frame is finished once the last segment with part of a snippet was read
+    for (int segment = SEGMENTS_PER_FRAME - 1; segment >= 0 && state.lastSegment < 0; segment--) {
+        if (!state.routes[segment].empty()) {
+            state.lastSegment = segment;
+        }
+    }
+}
+
+/*
+*  ==========================================================
+*  Sensor Streams
+*  ==========================================================
+*  Creates the state of each sensor the first time one of its packets arrives on a connection.
+*  A sensor uses the layout given with --sensor<N>=<location>,<location>,... if there is one, otherwise the electrode locations of the program.
+*/
+
+std::vector<int> sensorLayout(int sensor) {
+    string layout = getOption("sensor" + std::to_string(sensor), "");
+    if (layout.empty()) {
+        return electrodeLocations;
+    }
+    std::vector<int> locations;
+    std::istringstream list(layout);
+    string location;
+    while (std::getline(list, location, ',')) {
+        locations.push_back(std::stoi(location));
+    }
+    return locations;
+}
+
+SensorState& createSensorState(int sensor, const string& source) {
+    std::unique_ptr<SensorState> state(new SensorState());
+    state->sensor = sensor;
+    state->electrodeLocations = sensorLayout(sensor);
+    state->numElectrodes = state->electrodeLocations.size();
+    state->detector = createDetector(parameters, state->numElectrodes, getOption("kernel", "") == "generic");
+    state->partialSnippets.resize(state->numElectrodes);
+    state->weightOffsets = std::max(1, parameters.width - 1);
+    state->frames = std::vector<FrameSlot>(FRAME_SLOTS);
+    state->aboveThreshold.assign(state->numElectrodes, 0);
+    state->covered.assign(state->numElectrodes, 0);
+    for (FrameSlot& slot : state->frames) {
+        slot.weighed.reset(new std::atomic<bool>[state->numElectrodes]());
+        slot.weights.reset(new int16_t[state->numElectrodes * state->weightOffsets]());
+    }
+
+    std::lock_guard<std::mutex> lock(sensorStatesMutex);
+    state->stream = sensorStates.size();
+    buildRoutes(*state);
+    bool restored = checkpoint.restore(*state);
+    cout << "Stream " << state->stream << ": sensor " << sensor << " from " << source << ", " << state->numElectrodes << " electrodes, "
+        << (state->detector->specialized() ? "specialized" : "generic") << " kernel" << (restored ? ", background restored from checkpoint" : "") << endl;
+    sensorStates.push_back(std::move(state));
+    return *sensorStates.back();
+}
+
+// The streams of one connection, only used by the thread reading it
+class SensorStreams {
+public:
+    explicit SensorStreams(const string& source) : source(source) {}
+
+    ~SensorStreams() {
+        close();
+    }
+
+    SensorState& get(int sensor) {
+        if (!states[sensor]) {
+            states[sensor] = &createSensorState(sensor, source);
+        }
+        return *states[sensor];
+    }
+
+    // Lets the last frame of every stream be decided once no more packets will arrive
+    void close() {
+        for (SensorState* state : states) {
+            if (state) {
+                closeFrame(*state);
+            }
+        }
+    }
+
+private:
+    string source;  // Where the packets come from, for the log
+    std::array<SensorState*, 256> states = {};  // Indexed by the sensor byte of the packet header
+};
+
+/*
+*  ==========================================================
+*  Snippet Processing Function
+*  ==========================================================
+*  Extracts all snippets from the packet and processes them.
+*  Processing includes calculating remedians for each pixel and detecting a particle.
+*/
+
+void processSnippets(SensorState& state, const std::array<uint8_t, PACKET_LENGTH>& packet, int frame, int segment, int led_config, Timestamp arrival) {
+    /* <!> Snippet Data Extraction and Processing <!> */
+    // Saves the parts of each snippet contained in the segment
+    if (segment < 1 || segment > SEGMENTS_PER_FRAME || state.lastSegment < 0) {
+        return;
+    }
+
+    // A new frame means the previous one gets no more snippets, even if its last segment was lost
+    if (frame != state.frame) {
+        closeFrame(state);
+        openFrame(state, frame, arrival);
+    }
+    else if (!state.frameOpen) {
+        return;  // The frame was already finished
+    }
+    FrameSlot& slot = frameSlot(state, frame);
+    slot.arrival.store(arrival.time_since_epoch().count(), std::memory_order_relaxed);
+    bool saveState = checkpoint.saves(frame);
+
+    // Decodes the whole segment once, for every snippet it has part of
+    if (!state.routes[segment - 1].empty()) {
+        decodeSegment(state, packet.data(), segment);
+    }
+
+    // Loops through only the electrodes with pixels in this segment
+    for (const SnippetRoute& route : state.routes[segment - 1]) {
+        PartialSnippet& snippet = state.partialSnippets[route.electrode];
+        if (snippet.frame != frame) {
+            snippet.frame = frame;
+            snippet.parts = 0;
+        }
+        snippet.parts++;
+
+        // Waits for the next segment if the snippet continues past this one
+        if (!route.completes) {
+            continue;
+        }
+        if (snippet.parts != snippet.totalParts) {
+            state.incompleteSnippets++;
+            continue;
+        }
+
+        // Sends the snippet to its electrode's lane to calculate the remedian and process it
+        // Streams start on different lanes, so the electrodes of several streams are spread over every lane
+        int electrode = route.electrode;
+        Snippet pixels = {};
+        readSnippet(state, electrode, pixels);
+        slot.references.fetch_add(1, std::memory_order_relaxed);
+        lanes[(state.stream + electrode) % numLanes]->push({ &state, pixels, frame, segment, led_config, electrode, &slot, arrival, saveState });
+    }
+
+    // The particle decision is made once every electrode of the frame had its weight calculated
+    if (segment - 1 == state.lastSegment) {
+        closeFrame(state);
+    }
+}
+
+/*
+*  ==========================================================
+*  Packet Processing Function
+*  ==========================================================
+*  Reads the header information of a packet, stores it if needed and processes its snippets with the state of its sensor.
+*  Returns the frame number of the packet.
+*/
+
+int processPacket(SensorStreams& streams, const std::array<uint8_t, PACKET_LENGTH>& packet, Timestamp arrival) {
+    // Stores the initial packet information
+    SegmentHeader header = readHeader(packet.data());
+
+    /* <!> Data Collection and Storage <!> */
+    // Appends the binary data to the data file (given by filePath)
+    if (writeFile) {
+        capture.write(packet);
+    }
+
+    processSnippets(streams.get(header.sensor), packet, header.frame, header.segment, header.ledConfig, arrival);
+    statistics.record(DECODE_STAGE, arrival);
+    statistics.count(PACKET_COUNTER);
+
+    //logSegment(header.frame, header.segment, packet);
+
+    return header.frame;
+}
+
+/*
+*  ==========================================================
+*  Multi-Connection Server
+*  ==========================================================
+*  Accepts any number of connections on every --listen endpoint, instead of the single connection of the default mode.
+*  Connections are spread over a pool of io_contexts, each run by one thread pinned to its own core, so a connection is always read on the same core.
+*  Each read takes as many bytes as the socket has ready into the connection's buffer, and the whole packets are processed in place.
+*  Every connection has its own streams, so each sensor of each connection keeps its own electrode layout and detector.
+*  The server runs until SIGINT or SIGTERM, or until --connections connections have closed.
+*/
+
+// Pins the calling thread to a core, where the platform supports it
+void pinThread(int core) {
+#ifdef __linux__
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core % std::max(1u, std::thread::hardware_concurrency()), &cores);
+    pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+#endif
+}
+
+// Reads a list of "address:port" endpoints separated by commas, where an empty address listens on every interface
+std::vector<tcp::endpoint> parseEndpoints(const string& list) {
+    std::vector<tcp::endpoint> endpoints;
+    std::istringstream entries(list);
+    string entry;
+    while (std::getline(entries, entry, ',')) {
+        size_t colon = entry.rfind(':');
+        string address = colon == string::npos ? "" : entry.substr(0, colon);
+        int port = std::stoi(colon == string::npos ? entry : entry.substr(colon + 1));
+        endpoints.emplace_back(address.empty() ? boost::asio::ip::address_v4::any() : boost::asio::ip::address::from_string(address), port);
+    }
+    return endpoints;
+}
+
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+    Connection(tcp::socket socket, const string& source, std::function<void()> onClose)
+        : socket(std::move(socket)), source(source), streams(source), data(new uint8_t[BUFFER_BYTES]), onClose(onClose) {}
+
+    void start() {
+        cout << "Accepted " << source << endl;
+        read();
+    }
+
+private:
+    static const size_t BUFFER_BYTES = 256 * PACKET_LENGTH;
+
+    void read() {
+        std::shared_ptr<Connection> self = shared_from_this();
+        socket.async_read_some(buffer(data.get() + filled, BUFFER_BYTES - filled), [this, self](const boost::system::error_code& error, size_t bytes) {
+            if (error) {
+                cout << source << " closed after " << packets << " packets: " << error.message() << endl;
+                onClose();
+                return;
+            }
+
+            // Processes every whole packet in the buffer
+            Timestamp arrival = std::chrono::steady_clock::now();
+            filled += bytes;
+            size_t whole = filled / PACKET_LENGTH * PACKET_LENGTH;
+            for (size_t offset = 0; offset < whole; offset += PACKET_LENGTH) {
+                processPacket(streams, *reinterpret_cast<const std::array<uint8_t, PACKET_LENGTH>*>(data.get() + offset), arrival);
+                packets++;
+            }
+
+            // Moves the start of a split packet to the front of the buffer, for the next read to complete
+            std::memmove(data.get(), data.get() + whole, filled - whole);
+            filled -= whole;
+            read();
+        });
+    }
+
+    tcp::socket socket;
+    string source;
+    SensorStreams streams;
+    std::unique_ptr<uint8_t[]> data;
+    size_t filled = 0;  // # of bytes in the buffer
+    long long packets = 0;
+    std::function<void()> onClose;
+};
+
+class Server {
+public:
+    // Serves every endpoint until stopped, closing after maxConnections connections if it isn't 0
+    void run(const std::vector<tcp::endpoint>& endpoints, int threads, int maxConnections) {
+        connectionLimit = maxConnections;
+        for (int thread = 0; thread < std::max(1, threads); thread++) {
+            contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+            guards.push_back(std::make_unique<Guard>(boost::asio::make_work_guard(*contexts.back())));
+        }
+
+        for (const tcp::endpoint& endpoint : endpoints) {
+            acceptors.push_back(std::make_unique<tcp::acceptor>(*contexts[0], endpoint));
+            cout << "Listening on " << endpoint << endl;
+            accept(*acceptors.back());
+        }
+        signals = std::make_unique<boost::asio::signal_set>(*contexts[0], SIGINT, SIGTERM);
+        signals->async_wait([this](const boost::system::error_code& error, int) {
+            if (!error) {
+                stop();
+            }
+        });
+
+        std::vector<std::thread> workers;
+        for (size_t thread = 0; thread < contexts.size(); thread++) {
+            workers.emplace_back([this, thread] {
+                pinThread(thread);
+                contexts[thread]->run();
+            });
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void stop() {
+        for (std::unique_ptr<boost::asio::io_context>& context : contexts) {
+            context->stop();
+        }
+    }
+
+private:
+    typedef boost::asio::executor_work_guard<boost::asio::io_context::executor_type> Guard;
+
+    // Accepts the next connection onto the next io_context in turn
+    void accept(tcp::acceptor& acceptor) {
+        boost::asio::io_context& context = *contexts[nextContext++ % contexts.size()];
+        acceptor.async_accept(context, [this, &acceptor](const boost::system::error_code& error, tcp::socket socket) {
+            if (error) {
+                return;
+            }
+            boost::system::error_code ignored;
+            std::ostringstream source;
+            source << socket.remote_endpoint(ignored) << " on " << acceptor.local_endpoint(ignored);
+            std::make_shared<Connection>(std::move(socket), source.str(), [this] { closed(); })->start();
+            accept(acceptor);
+        });
+    }
+
+    void closed() {
+        if (connectionLimit > 0 && ++closedConnections >= connectionLimit) {
+            stop();
+        }
+    }
+
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    std::vector<std::unique_ptr<Guard>> guards;
+    std::vector<std::unique_ptr<tcp::acceptor>> acceptors;
+    std::unique_ptr<boost::asio::signal_set> signals;
+    size_t nextContext = 0;  // Only used by the first io_context's thread
+    int connectionLimit = 0;
+    std::atomic<int> closedConnections{ 0 };
+};
+
+/*
+*  ==========================================================
+*  Replay Function
+*  ==========================================================
+*  Feeds a recorded capture file through the same processing path as the ethernet data.
+*  The file can either be raw packets or have the header block written by start.py.
+*  A pace of 0 replays as fast as possible, otherwise each packet is sent every pace microseconds.
+*  Useful for measuring the throughput of the program without the Raspberry Pi.
+*/
+
+// Finds the offset of the first packet at or after a frame, using the capture's sidecar index if it has one
+size_t findFrame(const string& path, const uint8_t* data, size_t size, size_t offset, uint64_t frame) {
+    std::ifstream indexFile(path + ".idx", std::ios::in | std::ios::binary | std::ios::ate);
+    if (indexFile) {
+        std::vector<FrameIndexEntry> index(indexFile.tellg() / sizeof(FrameIndexEntry));
+        indexFile.seekg(0);
+        indexFile.read((char*)index.data(), index.size() * sizeof(FrameIndexEntry));
+        auto entry = std::lower_bound(index.begin(), index.end(), frame, [](const FrameIndexEntry& a, uint64_t b) { return a.frame < b; });
+        return entry == index.end() ? size : entry->offset;
+    }
+
+    // Otherwise scans through the packets until the frame is reached
+    while (offset + PACKET_LENGTH <= size) {
+        const uint8_t* packet = data + offset;
+        uint64_t packetFrame = (uint32_t)(packet[0] << 24 | packet[1] << 16 | packet[2] << 8 | packet[3]);
+        if (packetFrame >= frame) {
+            break;
+        }
+        offset += PACKET_LENGTH;
+    }
+    return offset;
+}
+
+void replay(const string& path, int pace, uint64_t startFrame) {
+    // Memory maps the capture file so the packets are read straight from the page cache
+    boost::interprocess::file_mapping mapping(path.c_str(), boost::interprocess::read_only);
+    boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+    const uint8_t* data = static_cast<const uint8_t*>(region.get_address());
+    size_t size = region.get_size();
+
+    // Skips the header block if the file was initialized by start.py
+    size_t offset = 0;
+    if (size % PACKET_LENGTH == HEADER_LENGTH) {
+        offset = HEADER_LENGTH;
+    }
+
+    // Starts from a later frame if requested
+    if (startFrame > 0) {
+        offset = findFrame(path, data, size, offset, startFrame);
+    }
+
+    SensorStreams streams("replay of " + path);
+    long long packets = 0;
+    long long frames = 0;
+    int lastFrame = -1;
+
+    auto start = std::chrono::steady_clock::now();
+    auto next = start;
+
+    // Walks through every whole packet in the file
+    while (offset + PACKET_LENGTH <= size) {
+        // Waits until the packet is due if the replay is paced
+        if (pace > 0) {
+            std::this_thread::sleep_until(next);
+            next += std::chrono::microseconds(pace);
+        }
+
+        // Processes the packet in place in the mapped file
+        const std::array<uint8_t, PACKET_LENGTH>& packet = *reinterpret_cast<const std::array<uint8_t, PACKET_LENGTH>*>(data + offset);
+        int frame = processPacket(streams, packet, std::chrono::steady_clock::now());
+
+        // Counts each new frame once, regardless of how many segments it was split into
+        if (frame != lastFrame) {
+            frames++;
+            lastFrame = frame;
+        }
+        packets++;
+        offset += PACKET_LENGTH;
+    }
+
+    // Waits for all snippets to finish processing before stopping the timer
+    streams.close();
+    for (std::unique_ptr<Lane>& lane : lanes) {
+        lane->waitIdle();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << "Replayed " << packets << " packets (" << frames << " frames) in " << seconds << "s" << endl;
+    if (seconds > 0) {
+        cout << packets / seconds << " packets/s, " << frames / seconds << " frames/s" << endl;
+    }
+}
+
+/*
+*  ==========================================================
+*  Batch Analysis
+*  ==========================================================
+*  Runs the detection over recorded capture files on every core with --batch=<file>,<file>,..., instead of post-processing the .csv files.
+*  The files are memory mapped and read as one capture in the order given, so the parts of a rotated capture are analyzed together.
+*  Each worker takes the electrodes of every stream that the same lane would take live, and reads every packet header itself,
+*  so the workers never wait on each other and only decode the pixels of their own electrodes.
+*  Each snippet goes through the same remedian and detection as the live path.
+*  A worker only records the frames where one of its electrodes passed the threshold, since electrodes below it never change a decision.
+*  The records of every worker are then merged by frame and decided with chooseElectrode, giving the particles in capture order.
+*/
+
+// A frame where an electrode's weight passed the threshold
+struct BatchRecord {
+    uint64_t opened;  // Index of the frame's first packet in the capture, which orders the frames in time
+    int stream;
+    int frame;
+    int electrode;
+    size_t weights;  // Index of the electrode's weightOffsets weights in its worker's weights
+};
+
+// Totals of one electrode over the whole capture
+struct BatchElectrode {
+    long long snippets = 0;
+    long long passed = 0;  // # of snippets whose weight passed the threshold
+    long long particles = 0;
+    int maxWeight = 0;
+    long long weightSum = 0;
+};
+
+struct BatchParticle {
+    int stream;
+    int frame;
+    int electrode;
+    int16_t weight;
+    bool similar;
+};
+
+class BatchWorker {
+public:
+    BatchWorker(int worker, int workers) : worker(worker), workers(workers) {
+        streamOf.fill(-1);
+    }
+
+    // Processes every packet of the captures, each given as the packets after its header block
+    void run(const std::vector<std::pair<const uint8_t*, size_t>>& captures) {
+        uint64_t index = 0;
+        for (const std::pair<const uint8_t*, size_t>& capture : captures) {
+            for (size_t offset = 0; offset + PACKET_LENGTH <= capture.second; offset += PACKET_LENGTH) {
+                const uint8_t* packet = capture.first + offset;
+                int sensor = packet[5];
+                if (streamOf[sensor] < 0) {
+                    addStream(sensor);
+                }
+                process(streamOf[sensor], packet, index);
+                index++;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<SensorState>> streams;  // In the order their sensors first appear, the same for every worker
+    std::vector<std::vector<BatchElectrode>> electrodes;  // [stream][electrode], only filled in for this worker's electrodes
+    std::vector<BatchRecord> records;
+    std::vector<int16_t> weights;
+
+private:
+    void addStream(int sensor) {
+        std::unique_ptr<SensorState> state(new SensorState());
+        state->stream = streams.size();
+        state->sensor = sensor;
+        state->electrodeLocations = sensorLayout(sensor);
+        state->numElectrodes = state->electrodeLocations.size();
+        state->detector = createDetector(parameters, state->numElectrodes, getOption("kernel", "") == "generic");
+        state->partialSnippets.resize(state->numElectrodes);
+        state->weightOffsets = std::max(1, parameters.width - 1);
+        buildRoutes(*state);
+        streamOf[sensor] = state->stream;
+        electrodes.emplace_back(state->numElectrodes);
+        opened.push_back(0);
+        streams.push_back(std::move(state));
+    }
+
+    // Follows processSnippets, for this worker's electrodes
+    void process(int stream, const uint8_t* packet, uint64_t index) {
+        SensorState& state = *streams[stream];
+        SegmentHeader header = readHeader(packet);
+        int frame = header.frame;
+        int segment = header.segment;
+        if (segment < 1 || segment > SEGMENTS_PER_FRAME || state.lastSegment < 0) {
+            return;
+        }
+        if (frame != state.frame) {
+            state.frame = frame;
+            state.frameOpen = true;
+            opened[stream] = index;
+        }
+        else if (!state.frameOpen) {
+            return;
+        }
+
+        for (const SnippetRoute& route : state.routes[segment - 1]) {
+            if ((state.stream + route.electrode) % workers != worker) {
+                continue;
+            }
+            PartialSnippet& snippet = state.partialSnippets[route.electrode];
+            if (snippet.frame != frame) {
+                snippet.frame = frame;
+                snippet.parts = 0;
+            }
+            // Only this worker's parts of the segment are decoded into the line
+            decodePixels(packet, route.firstPixel, route.count, state.line.data() + MAX_WIDTH + (segment - 1) * SEGMENT_PIXELS + route.firstPixel);
+            snippet.parts++;
+            if (!route.completes) {
+                continue;
+            }
+            if (snippet.parts != snippet.totalParts) {
+                state.incompleteSnippets++;
+                continue;
+            }
+            Snippet pixels = {};
+            readSnippet(state, route.electrode, pixels);
+            detect(state, route.electrode, pixels, frame, opened[stream]);
+        }
+
+        if (segment - 1 == state.lastSegment) {
+            state.frameOpen = false;
+        }
+    }
+
+    void detect(SensorState& state, int electrode, const Snippet& snippet, int frame, uint64_t frameOpened) {
+        size_t first = weights.size();
+        weights.resize(first + state.weightOffsets);
+        state.detector->updateRemedian(electrode, snippet.data());
+        detectParticle(state, snippet, electrode, &weights[first]);
+
+        int16_t weight = weights[first];
+        BatchElectrode& totals = electrodes[state.stream][electrode];
+        totals.snippets++;
+        totals.weightSum += weight;
+        totals.maxWeight = std::max(totals.maxWeight, abs(weight));
+        if (abs(weight) >= parameters.threshold) {
+            totals.passed++;
+            records.push_back({ frameOpened, state.stream, frame, electrode, first });
+        }
+        else {
+            weights.resize(first);
+        }
+    }
+
+    int worker;
+    int workers;
+    std::array<int, 256> streamOf;  // Stream of each sensor, or -1 before its first packet
+    std::vector<uint64_t> opened;  // Index of the first packet of each stream's current frame
+};
+
+void batch(const string& list, int threads) {
+    auto start = std::chrono::steady_clock::now();
+
+    // Maps every capture, skipping the header block of files initialized by start.py
+    std::vector<std::unique_ptr<boost::interprocess::file_mapping>> mappings;
+    std::vector<std::unique_ptr<boost::interprocess::mapped_region>> regions;
+    std::vector<std::pair<const uint8_t*, size_t>> captures;
+    uint64_t packets = 0;
+    std::istringstream paths(list);
+    string path;
+    while (std::getline(paths, path, ',')) {
+        mappings.emplace_back(new boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only));
+        regions.emplace_back(new boost::interprocess::mapped_region(*mappings.back(), boost::interprocess::read_only));
+        regions.back()->advise(boost::interprocess::mapped_region::advice_sequential);
+        const uint8_t* data = static_cast<const uint8_t*>(regions.back()->get_address());
+        size_t size = regions.back()->get_size();
+        size_t offset = size % PACKET_LENGTH == HEADER_LENGTH ? HEADER_LENGTH : 0;
+        captures.push_back({ data + offset, (size - offset) / PACKET_LENGTH * PACKET_LENGTH });
+        packets += (size - offset) / PACKET_LENGTH;
+    }
+
+    // Every worker reads the whole capture for its share of the electrodes
+    int workers = std::max(1, threads);
+    std::vector<std::unique_ptr<BatchWorker>> batchWorkers;
+    std::vector<std::thread> workerThreads;
+    for (int worker = 0; worker < workers; worker++) {
+        batchWorkers.emplace_back(new BatchWorker(worker, workers));
+        workerThreads.emplace_back(&BatchWorker::run, batchWorkers.back().get(), std::cref(captures));
+    }
+    for (std::thread& thread : workerThreads) {
+        thread.join();
+    }
+
+    // Merges the totals and records of every worker, ordering the records by frame
+    const std::vector<std::unique_ptr<SensorState>>& streams = batchWorkers[0]->streams;
+    std::vector<std::vector<BatchElectrode>> electrodes = batchWorkers[0]->electrodes;
+    std::vector<std::pair<const BatchRecord*, const int16_t*>> records;
+    long long incompleteSnippets = 0;
+    for (const std::unique_ptr<BatchWorker>& worker : batchWorkers) {
+        for (size_t stream = 0; stream < streams.size(); stream++) {
+            incompleteSnippets += worker->streams[stream]->incompleteSnippets;
+            if (worker != batchWorkers[0]) {
+                for (size_t electrode = 0; electrode < electrodes[stream].size(); electrode++) {
+                    const BatchElectrode& totals = worker->electrodes[stream][electrode];
+                    BatchElectrode& merged = electrodes[stream][electrode];
+                    merged.snippets += totals.snippets;
+                    merged.passed += totals.passed;
+                    merged.weightSum += totals.weightSum;
+                    merged.maxWeight = std::max(merged.maxWeight, totals.maxWeight);
+                }
+            }
+        }
+        for (const BatchRecord& record : worker->records) {
+            records.push_back({ &record, &worker->weights[record.weights] });
+        }
+    }
+    std::sort(records.begin(), records.end(), [](const std::pair<const BatchRecord*, const int16_t*>& a, const std::pair<const BatchRecord*, const int16_t*>& b) {
+        return std::tie(a.first->opened, a.first->stream, a.first->electrode) < std::tie(b.first->opened, b.first->stream, b.first->electrode);
+    });
+
+    // Decides each frame from the electrodes which passed the threshold, with a weight of 0 for the others
+    std::vector<BatchParticle> particles;
+    std::vector<int16_t> frameWeights;
+    for (size_t first = 0; first < records.size();) {
+        const BatchRecord& frame = *records[first].first;
+        const SensorState& state = *streams[frame.stream];
+        frameWeights.assign(state.numElectrodes * state.weightOffsets, 0);
+        size_t last = first;
+        for (; last < records.size() && records[last].first->opened == frame.opened && records[last].first->stream == frame.stream; last++) {
+            std::copy_n(records[last].second, state.weightOffsets, frameWeights.begin() + records[last].first->electrode * state.weightOffsets);
+        }
+        bool similar;
+        int electrode = chooseElectrode(frameWeights.data(), state.numElectrodes, state.weightOffsets, parameters.threshold, similar);
+        if (electrode >= 0) {
+            particles.push_back({ frame.stream, frame.frame, electrode, frameWeights[electrode * state.weightOffsets], similar });
+            electrodes[frame.stream][electrode].particles++;
+        }
+        first = last;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Writes the particles in capture order and the totals of each electrode
+    string directory = getOption("log-dir", ".");
+    std::ofstream particleFile(directory + "/batch_particles.csv", std::ios::out | std::ios::trunc);
+    particleFile << "stream,sensor,frame,electrode,location,weight,similar\n";
+    for (const BatchParticle& particle : particles) {
+        const SensorState& state = *streams[particle.stream];
+        particleFile << particle.stream << "," << state.sensor << "," << particle.frame << "," << particle.electrode << ","
+            << state.electrodeLocations[particle.electrode] << "," << particle.weight << "," << particle.similar << "\n";
+    }
+    std::ofstream electrodeFile(directory + "/batch_electrodes.csv", std::ios::out | std::ios::trunc);
+    electrodeFile << "stream,sensor,electrode,location,snippets,passed,particles,max_weight,mean_weight\n";
+    for (size_t stream = 0; stream < streams.size(); stream++) {
+        const SensorState& state = *streams[stream];
+        for (int electrode = 0; electrode < state.numElectrodes; electrode++) {
+            const BatchElectrode& totals = electrodes[stream][electrode];
+            double meanWeight = totals.snippets > 0 ? (double)totals.weightSum / totals.snippets : 0;
+            electrodeFile << stream << "," << state.sensor << "," << electrode << "," << state.electrodeLocations[electrode] << "," << totals.snippets << ","
+                << totals.passed << "," << totals.particles << "," << totals.maxWeight << "," << meanWeight << "\n";
+            cout << "Stream " << stream << " electrode " << electrode << " at " << state.electrodeLocations[electrode] << ": " << totals.snippets
+                << " snippets, " << totals.passed << " passed the threshold, " << totals.particles << " particles, max weight " << totals.maxWeight
+                << ", mean weight " << meanWeight << endl;
+        }
+    }
+
+    cout << "Batch: " << captures.size() << " files, " << packets << " packets, " << streams.size() << " streams, " << particles.size()
+        << " particles in " << seconds << "s with " << workers << " workers";
+    if (seconds > 0) {
+        cout << ", " << packets / seconds << " packets/s";
+    }
+    cout << endl;
+    if (incompleteSnippets > 0) {
+        cout << incompleteSnippets << " snippets dropped because a segment was missing" << endl;
+    }
+}
+
+/*
+*  ==========================================================
+*  Synthetic Packet Generator
+*  ==========================================================
+*  Generates a deterministic stream of packets in the same layout as the sensor, for benchmarks and for testing without the Raspberry Pi.
+*  Every pixel is a background level, which drifts each frame, plus gaussian noise.
+*  Every particleInterval frames a particle passes over the next electrode, adding amplitude to the pixels around it for particleFrames frames.
+*  With a particle speed, each particle instead starts at the first electrode and moves along the sensor, passing every electrode in turn.
+*  Each frame is sent by every sensor in turn, with the same particles.
+*  The same seed always gives the same packets.
+*/
+
+struct GeneratorSettings {
+    uint32_t seed = 1;
+    double background = 2000;  // Starting pixel value
+    double noise = 50;  // Standard deviation of the pixel noise
+    double drift = 0;  // Change of the background each frame
+    int amplitude = 1000;  // Value added to the pixels under a particle, enough to pass the threshold only while the particle is in the snippet history
+    int particleInterval = 200;  // # of frames from the start of one particle to the next
+    int particleFrames = 10;  // # of frames each particle is visible
+    int particleRadius = 10;  // # of pixels on each side of the particle's center
+    double particleSpeed = 0;  // Pixels the particle moves each frame, or 0 for a particle standing still at one electrode
+    int sensors = 1;  // # of sensors sending each frame
+};
+
+// Reads the generator settings from the optional arguments
+GeneratorSettings generatorSettings() {
+    GeneratorSettings settings;
+    settings.seed = std::stoul(getOption("seed", "1"));
+    settings.noise = std::stod(getOption("noise", "50"));
+    settings.drift = std::stod(getOption("drift", "0"));
+    settings.amplitude = std::stoi(getOption("amplitude", "1000"));
+    settings.particleInterval = std::max(1, std::stoi(getOption("particle-interval", "200")));
+    settings.particleFrames = std::stoi(getOption("particle-frames", "10"));
+    settings.particleSpeed = std::stod(getOption("particle-speed", "0"));
+    settings.sensors = std::max(1, std::min(256, std::stoi(getOption("sensors", "1"))));
+    return settings;
+}
+
+class PacketGenerator {
+public:
+    PacketGenerator(const GeneratorSettings& settings, const std::vector<int>& locations)
+        : settings(settings), locations(locations), random(settings.seed), noise(0, settings.noise), background(settings.background) {}
+
+    // Writes the next segment of the current frame into a packet
+    void next(std::array<uint8_t, PACKET_LENGTH>& packet) {
+        // Finds the particle visible in this frame, if any
+        int center = -1;
+        int phase = frame % settings.particleInterval;
+        if (!locations.empty() && phase < settings.particleFrames) {
+            if (settings.particleSpeed > 0) {
+                center = *std::min_element(locations.begin(), locations.end()) + (int)(settings.particleSpeed * phase);
+            }
+            else if (settings.particleSpeed < 0) {
+                center = *std::max_element(locations.begin(), locations.end()) + (int)(settings.particleSpeed * phase);
+            }
+            else {
+                center = locations[(frame / settings.particleInterval) % locations.size()];
+            }
+        }
+
+        // Pixel i of the segment is stored in bytes 2i and 2i+1, the same bytes the snippets are read from
+        for (int index = 0; index < PACKET_LENGTH / 2; index++) {
+            int pixel = (segment - 1) * SEGMENT_PIXELS + index;
+            double value = background + noise(random);
+            if (center >= 0 && abs(pixel - center) <= settings.particleRadius) {
+                value += settings.amplitude;
+            }
+            int16_t sample = (int16_t)std::max(-32768.0, std::min(32767.0, value));
+            packet[index * 2] = sample & 0xFF;
+            packet[index * 2 + 1] = (sample >> 8) & 0xFF;
+        }
+
+        // The header overwrites the first pixels, as it does in the sensor's packets
+        packet[0] = frame >> 24;
+        packet[1] = frame >> 16;
+        packet[2] = frame >> 8;
+        packet[3] = frame;
+        packet[4] = segment;
+        packet[5] = sensor;
+        packet[6] = 0;
+        packet[7] = 1;
+
+        if (segment == SEGMENTS_PER_FRAME) {
+            if (center >= 0 && phase == 0) {
+                particles++;
+            }
+            segment = 1;
+            // Every sensor sends the frame before the next one starts
+            if (++sensor == settings.sensors) {
+                sensor = 0;
+                frame++;
+                background += settings.drift;
+            }
+        }
+        else {
+            segment++;
+        }
+    }
+
+    long long particles = 0;  // # of particles generated so far
+
+private:
+    GeneratorSettings settings;
+    std::vector<int> locations;
+    std::mt19937 random;
+    std::normal_distribution<double> noise;
+    double background;
+    uint32_t frame = 0;
+    int segment = 1;
+    int sensor = 0;
+};
+
+// Writes a capture file of generated frames which can be replayed or sent by simulate.py
+void generate(const string& path, long long frames) {
+    GeneratorSettings settings = generatorSettings();
+    PacketGenerator generator(settings, electrodeLocations);
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    std::array<uint8_t, PACKET_LENGTH> packet;
+    for (long long index = 0; index < frames * SEGMENTS_PER_FRAME * settings.sensors; index++) {
+        generator.next(packet);
+        file.write((const char*)packet.data(), PACKET_LENGTH);
+    }
+    cout << "Generated " << frames << " frames with " << generator.particles << " particles to " << path << endl;
+}
+
+/*
+*  ==========================================================
+*  Benchmark Function
+*  ==========================================================
+*  Times each stage of the processing on its own, then runs generated packets through the whole program.
+*  Each microbenchmark is repeated, and the fastest and mean time per call are reported, so the results can be compared between changes.
+*  The results are written as JSON to the --bench path, or to stdout if no path was given.
+*/
+
+struct BenchResult {
+    string name;
+    long long iterations;
+    double bestNanoseconds;  // Fastest repeat, per call
+    double meanNanoseconds;  // Mean of every repeat, per call
+};
+
+static const int BENCH_REPEATS = 5;
+
+// Times a function called with the iteration index, after one untimed repeat to warm up the caches
+template <typename Function>
+BenchResult measure(const string& name, long long iterations, Function function) {
+    BenchResult result = { name, iterations, 0, 0 };
+    for (int repeat = 0; repeat <= BENCH_REPEATS; repeat++) {
+        auto start = std::chrono::steady_clock::now();
+        for (long long index = 0; index < iterations; index++) {
+            function(index);
+        }
+        double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+        if (repeat == 0) {
+            continue;
+        }
+        result.bestNanoseconds = repeat == 1 ? nanoseconds : std::min(result.bestNanoseconds, nanoseconds);
+        result.meanNanoseconds += nanoseconds / BENCH_REPEATS;
+    }
+    cout << name << ": " << result.bestNanoseconds << "ns best, " << result.meanNanoseconds << "ns mean" << endl;
+    return result;
+}
+
+void waitLanes() {
+    for (std::unique_ptr<Lane>& lane : lanes) {
+        lane->waitIdle();
+    }
+}
+
+void benchmark(const string& outputPath) {
+    GeneratorSettings settings = generatorSettings();
+    long long iterations = std::stoll(getOption("bench-iterations", "100000"));
+    long long frames = std::stoll(getOption("frames", "20000"));
+    double lineRate = std::stod(getOption("line-rate", "0"));
+
+    // Generates every packet up front, so the generator isn't part of the timing
+    PacketGenerator generator(settings, electrodeLocations);
+    std::vector<std::array<uint8_t, PACKET_LENGTH>> packets(frames * SEGMENTS_PER_FRAME * settings.sensors);
+    for (std::array<uint8_t, PACKET_LENGTH>& packet : packets) {
+        generator.next(packet);
+    }
+    long long generated = generator.particles;
+
+    // Snippets of the first electrode, for the stages which work on one snippet at a time
+    static const int BENCH_SNIPPETS = 1024;
+    std::vector<Snippet> benchSnippets(BENCH_SNIPPETS);
+    for (int index = 0; index < BENCH_SNIPPETS; index++) {
+        const std::array<uint8_t, PACKET_LENGTH>& packet = packets[(index * SEGMENTS_PER_FRAME) % packets.size()];
+        decodePixels(packet.data(), 100, MAX_SNIPPET_PIXELS, benchSnippets[index].data());
+    }
+
+    std::vector<BenchResult> results;
+    volatile long long sink = 0;  // Keeps the compiler from removing the benchmarked work
+
+    // Header and pixel decode of a whole segment
+    std::array<int16_t, SEGMENT_PIXELS> line;
+    results.push_back(measure("decode", iterations, [&](long long index) {
+        const std::array<uint8_t, PACKET_LENGTH>& packet = packets[index % packets.size()];
+        SegmentHeader header = readHeader(packet.data());
+        decodePixels(packet.data(), 0, SEGMENT_PIXELS, line.data());
+        sink = sink + header.frame + line[index % SEGMENT_PIXELS];
+    }));
+
+    // Remedian of every pixel of a snippet, using the first electrode of a sensor
+    SensorStreams benchStreams("benchmark");
+    SensorState& state = benchStreams.get(0);
+    Detector& detector = *state.detector;
+    results.push_back(measure("remedian", iterations, [&](long long index) {
+        detector.updateRemedian(0, benchSnippets[index % BENCH_SNIPPETS].data());
+        sink = sink + detector.remedian(0)[0];
+    }));
+
+    // The same remedian with each background, and its cost for every snippet of a packet
+    for (Background background : { MEAN_BACKGROUND, MEDIAN_BACKGROUND }) {
+        DetectionParameters backgroundParameters = parameters;
+        backgroundParameters.background = background;
+        std::unique_ptr<Detector> backgroundDetector = createDetector(backgroundParameters, numElectrodes, getOption("kernel", "") == "generic");
+        string name = background == MEDIAN_BACKGROUND ? "median" : "mean";
+        results.push_back(measure("remedian_" + name, iterations, [&](long long index) {
+            backgroundDetector->updateRemedian(0, benchSnippets[index % BENCH_SNIPPETS].data());
+            sink = sink + backgroundDetector->remedian(0)[0];
+        }));
+        results.push_back(measure("remedian_" + name + "_packet", std::min<long long>(iterations, packets.size()), [&](long long index) {
+            int segment = packets[index][4];
+            if (segment < 1 || segment > SEGMENTS_PER_FRAME) {
+                return;
+            }
+            // Each snippet completed by the packet's segment
+            for (const SnippetRoute& route : state.routes[segment - 1]) {
+                if (route.completes) {
+                    backgroundDetector->updateRemedian(route.electrode, benchSnippets[index % BENCH_SNIPPETS].data());
+                }
+            }
+            sink = sink + backgroundDetector->remedian(0)[0];
+        }));
+    }
+
+    // Background subtraction, history update and 2D average of an electrode, with the narrower windows if it passes the threshold
+    std::vector<int16_t> benchWeights(state.weightOffsets);
+    results.push_back(measure("detect", iterations, [&](long long index) {
+        detectParticle(state, benchSnippets[index % BENCH_SNIPPETS], 0, benchWeights.data());
+        sink = sink + benchWeights[0];
+    }));
+
+    // 2D average of a snippet history, for the full window and the narrowed tie-break windows
+    results.push_back(measure("weight", iterations, [&](long long) {
+        sink = sink + detector.weight(0, 0);
+    }));
+    results.push_back(measure("weight_offsets", iterations, [&](long long) {
+        int sum = 0;
+        for (int offset = 1; offset < state.weightOffsets; offset++) {
+            sum += detector.weight(0, offset);
+        }
+        sink = sink + sum;
+    }));
+
+    // Copy of an electrode's background state, which each lane makes every --checkpoint-frames frames with --checkpoint
+    std::vector<uint8_t> benchState(backgroundStateBytes(parameters));
+    results.push_back(measure("checkpoint_save", iterations, [&](long long index) {
+        detector.saveState(0, benchState.data());
+        sink = sink + benchState[index % benchState.size()];
+    }));
+
+    // Tracker update of a frame, for a particle passing each electrode in turn every TRACK_FRAMES frames
+    // It runs on its own stream, and the commands it sends ahead of the particle are written like any other
+    static const int TRACK_FRAMES = 20;
+    SensorStreams trackStreams("benchmark tracking");
+    SensorState& trackState = trackStreams.get(0);
+    std::vector<int16_t> trackWeights(trackState.numElectrodes * trackState.weightOffsets);
+    int trackFrame = 0;  // Keeps counting across repeats, since the tracker ignores frames older than the last one
+    results.push_back(measure("track", iterations, [&](long long) {
+        int phase = trackFrame % (TRACK_FRAMES * (trackState.numElectrodes + 2));
+        for (int electrode = 0; electrode < trackState.numElectrodes; electrode++) {
+            bool above = phase >= electrode * TRACK_FRAMES && phase < electrode * TRACK_FRAMES + parameters.snippetDepth;
+            trackWeights[electrode * trackState.weightOffsets] = above ? parameters.threshold : 0;
+        }
+        bool similar;
+        int electrode = chooseElectrode(trackWeights.data(), trackState.numElectrodes, trackState.weightOffsets, parameters.threshold, similar);
+        sink = sink + tracker.update(trackState, trackFrame++, trackWeights.data(), electrode, std::chrono::steady_clock::now());
+    }));
+    trackStreams.close();
+
+    // Snippet extraction and handoff to the lanes, including the lanes finishing every snippet
+    long long packetIterations = std::min<long long>(iterations, packets.size());
+    results.push_back(measure("process_snippets", packetIterations, [&](long long index) {
+        const std::array<uint8_t, PACKET_LENGTH>& packet = packets[index];
+        SegmentHeader header = readHeader(packet.data());
+        processSnippets(state, packet, header.frame, header.segment, header.ledConfig, std::chrono::steady_clock::now());
+        if (index == packetIterations - 1) {
+            benchStreams.close();
+            waitLanes();
+        }
+    }));
+
+    // Runs every generated packet through the program with new sensor states, paced to the line rate if one was given
+    waitLanes();
+    SensorStreams streams("benchmark end to end");
+    statistics.reset();
+    tracker.reset();
+    auto start = std::chrono::steady_clock::now();
+    auto next = start;
+    auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(lineRate > 0 ? 1 / (lineRate * SEGMENTS_PER_FRAME * settings.sensors) : 0));
+    for (const std::array<uint8_t, PACKET_LENGTH>& packet : packets) {
+        if (lineRate > 0) {
+            std::this_thread::sleep_until(next);
+            next += period;
+        }
+        processPacket(streams, packet, std::chrono::steady_clock::now());
+    }
+    streams.close();
+    waitLanes();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << "End to end: " << frames / seconds << " frames/s" << endl;
+
+    // Writes the results as JSON
+    std::ostringstream json;
+    json << "{\n  \"settings\": {\"electrodes\": " << numElectrodes << ", \"lanes\": " << numLanes << ", \"width\": " << parameters.width
+        << ", \"snippet_depth\": " << parameters.snippetDepth << ", \"depth\": " << parameters.depth << ", \"layers\": " << parameters.layers
+        << ", \"background\": \"" << (parameters.background == MEDIAN_BACKGROUND ? "median" : "mean")
+        << "\", \"kernel\": \"" << (detector.specialized() ? "specialized" : "generic") << "\", \"sensors\": " << settings.sensors << ", \"seed\": " << settings.seed
+        << ", \"noise\": " << settings.noise << ", \"drift\": " << settings.drift << ", \"amplitude\": " << settings.amplitude
+        << ", \"particle_interval\": " << settings.particleInterval << ", \"particle_speed\": " << settings.particleSpeed << ", \"line_rate\": " << lineRate << ", \"frames\": " << frames << "},\n";
+    json << "  \"microbenchmarks\": [\n";
+    for (size_t index = 0; index < results.size(); index++) {
+        json << "    {\"name\": \"" << results[index].name << "\", \"iterations\": " << results[index].iterations
+            << ", \"best_ns\": " << results[index].bestNanoseconds << ", \"mean_ns\": " << results[index].meanNanoseconds << "}"
+            << (index + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ],\n  \"end_to_end\": {\"seconds\": " << seconds << ", \"frames_per_second\": " << frames / seconds
+        << ", \"packets_per_second\": " << packets.size() / seconds << ", \"particles_generated\": " << generated
+        << ", \"particles_detected\": " << statistics.total(PARTICLE_COUNTER) << ", \"latency_ns\": {";
+    for (int stage = 0; stage < NUM_STAGES; stage++) {
+        StageSummary summary = statistics.summarize((Stage)stage);
+        json << (stage == 0 ? "\n" : ",\n") << "    \"" << STAGE_NAMES[stage] << "\": {\"count\": " << summary.count << ", \"p50\": " << summary.p50
+            << ", \"p99\": " << summary.p99 << ", \"p999\": " << summary.p999 << ", \"max\": " << summary.max << "}";
+    }
+    json << "\n  }";
+    if (tracker.enabled()) {
+        TrackerSummary summary = tracker.summarize();
+        json << ", \"tracker\": {\"lead_frames\": " << summary.lead << ", \"particles\": " << summary.tracks << ", \"predictions\": " << summary.predictions
+            << ", \"mean_error_frames\": " << summary.meanError << ", \"max_error_frames\": " << summary.maxError << ", \"ahead\": " << summary.ahead
+            << ", \"mean_lead_frames\": " << summary.meanLeadFrames << ", \"mean_lead_us\": " << summary.meanLeadMicroseconds
+            << ", \"late\": " << summary.late << ", \"missed\": " << summary.missed << ", \"covered\": " << summary.covered << "}";
+    }
+    json << "}\n}\n";
+
+    if (outputPath.empty() || outputPath == "1") {
+        cout << json.str();
+    }
+    else {
+        std::ofstream(outputPath, std::ios::out | std::ios::trunc) << json.str();
+        cout << "Benchmark results written to " << outputPath << endl;
+    }
+}
+
+/*
+*  ==========================================================
+*  Log Conversion Function
+*  ==========================================================
+*  Converts the binary files written by the logger into the original .csv layouts:
+*  out<N>.csv, remedians<N>.csv, locations.csv, particles.csv and fullData.csv.
+*/
+
+// Reads every record from a logger file, rebuilding each record from its columns
+template <typename Record>
+std::vector<Record> readRecords(const string& path) {
+    std::vector<Record> records;
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    BlockHeader header;
+    while (file.read((char*)&header, sizeof(header))) {
+        if (header.magic != BLOCK_MAGIC || header.type != Record::TYPE || header.recordSize != sizeof(Record)) {
+            std::cerr << path << " was not written with the same record layout" << endl;
+            break;
+        }
+        std::vector<uint8_t> block(header.count * sizeof(Record));
+        file.read((char*)block.data(), block.size());
+
+        size_t first = records.size();
+        records.resize(first + header.count);
+        const uint8_t* column = block.data();
+        for (const Column& field : RECORD_COLUMNS[Record::TYPE]) {
+            for (size_t record = 0; record < header.count; record++) {
+                std::memcpy((uint8_t*)&records[first + record] + field.offset, column + record * field.size, field.size);
+            }
+            column += header.count * field.size;
+        }
+    }
+    return records;
+}
+
+// Stream 0 keeps the original file names, and every other stream's files start with "stream<N>_"
+string streamPrefix(int stream) {
+    return stream == 0 ? "" : "stream" + std::to_string(stream) + "_";
+}
+
+// The .csv files are written next to the logs they were converted from
+void convertLogs(const string& directory) {
+    std::map<std::pair<int, int>, std::ofstream> outputs;
+    auto output = [&](const string& name, int stream, int electrode) -> std::ofstream& {
+        std::ofstream& file = outputs[{ stream, electrode }];
+        if (!file.is_open()) {
+            file.open(directory + "/" + streamPrefix(stream) + name + std::to_string(electrode) + ".csv", std::ios::out | std::ios::trunc);
+        }
+        return file;
+    };
+    auto streamOutput = [&](const string& name, int stream) -> std::ofstream& {
+        std::ofstream& file = outputs[{ stream, -1 }];
+        if (!file.is_open()) {
+            file.open(directory + "/" + streamPrefix(stream) + name, std::ios::out | std::ios::trunc);
+        }
+        return file;
+    };
+
+    // Snippets minus their remedians, followed by the raw snippets
+    std::vector<SnippetRecord> snippetRecords = readRecords<SnippetRecord>(directory + "/" + RECORD_FILES[SNIPPET_RECORD]);
+    for (const SnippetRecord& record : snippetRecords) {
+        std::ofstream& file = output("out", record.stream, record.electrode);
+        file << record.frame << "," << (int)record.segment << "," << (int)record.sensor << "," << record.ledConfig;
+        for (int pixel = 0; pixel < record.size; pixel++) {
+            file << "," << record.pixels[pixel] - record.remedians[pixel];
+        }
+        for (int pixel = 0; pixel < record.size; pixel++) {
+            file << "," << record.pixels[pixel];
+        }
+        file << "\n";
+    }
+    outputs.clear();
+
+    std::vector<RemedianRecord> remedianRecords = readRecords<RemedianRecord>(directory + "/" + RECORD_FILES[REMEDIAN_RECORD]);
+    for (const RemedianRecord& record : remedianRecords) {
+        std::ofstream& file = output("remedians", record.stream, record.electrode);
+        for (int pixel = 0; pixel < record.size; pixel++) {
+            file << record.remedians[pixel] << ",";
+        }
+        file << "\n";
+    }
+    outputs.clear();
+
+    // Locations come from several threads, so they are put back in frame order
+    std::vector<LocationRecord> locationRecords = readRecords<LocationRecord>(directory + "/" + RECORD_FILES[LOCATION_RECORD]);
+    std::stable_sort(locationRecords.begin(), locationRecords.end(), [](const LocationRecord& a, const LocationRecord& b) { return a.frame < b.frame; });
+    for (const LocationRecord& record : locationRecords) {
+        streamOutput("locations.csv", record.stream) << record.frame << "," << record.location << "," << record.weight << "\n";
+    }
+    outputs.clear();
+
+    // Each particle is followed by a line with the snippet history of every electrode, in frame order
+    std::vector<ParticleRecord> particleRecords = readRecords<ParticleRecord>(directory + "/" + RECORD_FILES[PARTICLE_RECORD]);
+    std::vector<HistoryRecord> historyRecords = readRecords<HistoryRecord>(directory + "/" + RECORD_FILES[HISTORY_RECORD]);
+    std::sort(particleRecords.begin(), particleRecords.end(), [](const ParticleRecord& a, const ParticleRecord& b) {
+        return a.frame < b.frame || (a.frame == b.frame && a.particle < b.particle);
+    });
+    std::stable_sort(historyRecords.begin(), historyRecords.end(), [](const HistoryRecord& a, const HistoryRecord& b) {
+        if (a.particle != b.particle) {
+            return a.particle < b.particle;
+        }
+        return a.electrode < b.electrode || (a.electrode == b.electrode && a.age < b.age);
+    });
+    for (const ParticleRecord& record : particleRecords) {
+        std::ofstream& file = streamOutput("particles.csv", record.stream);
+        file << record.electrode << "," << record.frame << "," << record.weight << "," << (int)record.similar << "\n";
+        size_t history = std::lower_bound(historyRecords.begin(), historyRecords.end(), record.particle,
+            [](const HistoryRecord& row, uint32_t particle) { return row.particle < particle; }) - historyRecords.begin();
+        for (; history < historyRecords.size() && historyRecords[history].particle == record.particle; history++) {
+            const HistoryRecord& row = historyRecords[history];
+            for (int pixel = 0; pixel < row.size; pixel++) {
+                file << row.pixels[pixel] << ",";
+            }
+            // Ends the line after the electrode's last row
+            if (history + 1 == historyRecords.size() || historyRecords[history + 1].particle != row.particle
+                || historyRecords[history + 1].electrode != row.electrode) {
+                file << "\n";
+            }
+        }
+    }
+    outputs.clear();
+
+    std::vector<SegmentRecord> segmentRecords = readRecords<SegmentRecord>(directory + "/" + RECORD_FILES[SEGMENT_RECORD]);
+    if (!segmentRecords.empty()) {
+        std::ofstream file(directory + "/fullData.csv", std::ios::out | std::ios::trunc);
+        for (const SegmentRecord& record : segmentRecords) {
+            file << record.frame << "," << (int)record.segment << "\n";
+            for (int16_t pixel : record.pixels) {
+                file << pixel << ",";
+            }
+            file << "\n";
+        }
+    }
+
+    cout << "Converted " << snippetRecords.size() << " snippets, " << remedianRecords.size() << " remedians, " << locationRecords.size()
+        << " locations, " << particleRecords.size() << " particles and " << segmentRecords.size() << " segments" << endl;
+}
+
+/*
+*  ==========================================================
+*  Shutdown Function
+*  ==========================================================
+*  Finishes processing every queued snippet, then stops all background threads once their output is written.
+*/
+
+void shutdown() {
+    watchdog.stop();
+    stopPool();
+    reportPool();
+    checkpoint.stop();
+    checkpoint.report();
+    long long incompleteSnippets = 0;
+    long long lateFrames = 0;
+    long long slotWaits = 0;
+    for (const std::unique_ptr<SensorState>& state : sensorStates) {
+        incompleteSnippets += state->incompleteSnippets;
+        lateFrames += state->lateFrames;
+        slotWaits += state->slotWaits;
+    }
+    if (incompleteSnippets > 0) {
+        cout << incompleteSnippets << " snippets dropped because a segment was missing" << endl;
+    }
+    if (lateFrames > 0 || slotWaits > 0) {
+        cout << lateFrames << " frames decided at the deadline, " << slotWaits << " waits for a frame slot" << endl;
+    }
+    tracker.report();
+    actuator.stop();
+    actuator.report();
+    telemetry.stop();
+    telemetry.report();
+    logger.stop();
+    logger.report();
+    if (writeFile) {
+        capture.stop();
+        capture.report();
+    }
+    statistics.stop();
+    cout << statistics.report();
+}
+
+/*
+*  ==========================================================
+*  Main Function
+*  ==========================================================
+*/
+
+int main(int argc, char* argv[]) {
+
+    boost::asio::io_context io_service; // I/O context needed for reading the ethernet data
+
+    /* <!> Input Parameters Processing <!> */
+    // Separates optional "--name=value" arguments from the positional arguments
+    std::vector<string> args;
+    for (int index = 1; index < argc; index++) {
+        string arg = argv[index];
+        if (arg.rfind("--", 0) == 0) {
+            size_t equals = arg.find('=');
+            if (equals == string::npos) {
+                options[arg.substr(2)] = "1";
+            }
+            else {
+                options[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+            }
+        }
+        else {
+            args.push_back(arg);
+        }
+    }
+
+    // Reads the options in a config file, which the command line takes priority over
+    if (options.count("config") && !readConfig(options["config"])) {
+        return 1;
+    }
+    if (!readParameters(parameters)) {
+        return 1;
+    }
+
+    // Reads all data inputted to the program.
+    if (args.size() > 0) {  // If arguments are given to the program
+        dataPath = args[0];
+        writeFile = std::stoi(args[1]);
+        writeSnippets = std::stoi(args[2]);
+        writeRemedians = std::stoi(args[3]);
+        writeParticles = std::stoi(args[4]);
+        for (size_t index = 5; index < args.size(); index++) {
+            electrodeLocations.push_back(std::stoi(args[index]));
+        }
+        numElectrodes = electrodeLocations.size();
+    }
+    else {  // If no arguments were given, use default data
+        dataPath = "data.bin";
+        writeFile = false;
+        writeSnippets = false;
+        writeRemedians = false;
+        writeParticles = false;
+        electrodeLocations = { 500, 750, 1000, 1250 };
+        numElectrodes = 4;
+    }
+
+    // Spaces a number of electrodes evenly across the sensor instead, for sizing larger electrode arrays
+    if (options.count("electrodes")) {
+        numElectrodes = std::stoi(options["electrodes"]);
+        electrodeLocations.clear();
+        for (int electrode = 0; electrode < numElectrodes; electrode++) {
+            electrodeLocations.push_back((electrode + 1) * SEGMENTS_PER_FRAME * SEGMENT_PIXELS / (numElectrodes + 1));
+        }
+    }
+
+    /* <!> Log Conversion <!> */
+    // Converts the files written by the logger into .csv files instead of processing data
+    if (options.count("convert")) {
+        convertLogs(options["convert"]);
+        return 0;
+    }
+
+    /* <!> Telemetry Reader <!> */
+    // Prints the telemetry of a running program instead of processing data
+    if (options.count("telemetry-read")) {
+        readTelemetry(options["telemetry-read"], std::stoll(getOption("telemetry-records", "0")));
+        return 0;
+    }
+
+    /* <!> Batch Analysis <!> */
+    // Runs the detection over capture files on every core instead of processing live data
+    if (options.count("batch")) {
+        batch(options["batch"], std::stoi(getOption("batch-threads", std::to_string(std::max(1u, std::thread::hardware_concurrency())))));
+        return 0;
+    }
+
+    /* <!> Packet Generation <!> */
+    // Writes a synthetic capture file instead of processing data
+    if (options.count("generate")) {
+        generate(options["generate"], std::stoll(getOption("frames", "20000")));
+        return 0;
+    }
+
+    // Uses a lane for each core, but no more lanes than electrodes when there is only one stream
+    int hardwareThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    int defaultLanes = options.count("listen") ? hardwareThreads : std::min(hardwareThreads, std::max(1, numElectrodes));
+    startPool(std::stoi(getOption("lanes", std::to_string(defaultLanes))));
+    actuator.start(getOption("actuator", "COM6"), std::stoi(getOption("baud", "9600")), getOption("actuator-log", ""));
+    logger.start(getOption("log-dir", "."), options.count("log-drop") > 0);
+    if (writeFile) {
+        capture.start(dataPath, std::stoll(getOption("capture-max-mb", "0")) * 1024 * 1024, std::stoi(getOption("capture-max-seconds", "0")));
+    }
+
+    statistics.start(getOption("stats-socket", ""));
+    int deadline = std::stoi(getOption("decision-deadline", "0"));
+    if (deadline > 0) {
+        watchdog.start(std::chrono::microseconds(deadline));
+    }
+    if (options.count("track")) {
+        tracker.start(std::stoi(getOption("track-lead", "5")), std::max(1, std::stoi(getOption("track-gap", "100"))));
+    }
+    if (options.count("telemetry")) {
+        telemetry.start(options["telemetry"], std::max(1, std::stoi(getOption("telemetry-slots", "16384"))), std::stoi(getOption("telemetry-sample", "100")));
+    }
+    if (options.count("checkpoint")) {
+        checkpoint.start(options["checkpoint"], std::max(1, std::stoi(getOption("checkpoint-frames", "1000"))),
+            std::max(1, std::stoi(getOption("checkpoint-seconds", "10"))));
+    }
+
+    cout << "C++ Program Start" << endl;
+    cout << "Detection: width " << parameters.width << ", snippet depth " << parameters.snippetDepth << ", depth " << parameters.depth << ", "
+        << parameters.layers << " layers, threshold " << parameters.threshold << ", " << (parameters.background == MEDIAN_BACKGROUND ? "median" : "mean")
+        << " background" << endl;
+
+    /* <!> Replay Mode <!> */
+    // Processes a recorded capture file instead of waiting for a connection
+    if (options.count("replay")) {
+        replay(options["replay"], std::stoi(getOption("pace", "0")), std::stoull(getOption("start-frame", "0")));
+        shutdown();
+        return 0;
+    }
+
+    /* <!> Benchmark Mode <!> */
+    // Times each processing stage and a run of generated packets
+    if (options.count("bench")) {
+        benchmark(options["bench"]);
+        shutdown();
+        return 0;
+    }
+
+    /* <!> Multi-Connection Server <!> */
+    // Serves several connections until stopped instead of a single connection
+    if (options.count("listen")) {
+        Server server;
+        server.run(parseEndpoints(options["listen"]), std::stoi(getOption("io-threads", std::to_string(std::max(1, hardwareThreads / 2)))),
+            std::stoi(getOption("connections", "0")));
+        shutdown();
+        return 0;
+    }
+
+    /* <!> Ethernet Connection <!> */
+    //listen for new connection
+    boost::system::error_code ec;
+    tcp::acceptor acceptor_(io_service, tcp::endpoint(boost::asio::ip::address::from_string(IP), PORT));
+    tcp::socket socket_(io_service);  // Creates a socket for the connection
+    acceptor_.accept(socket_);  // Accepts the connection
+    cout << "accepted" << endl;
+
+    PacketRing ring;
+    ring.start(socket_);
+    std::ostringstream source;
+    source << socket_.remote_endpoint(ec);
+    SensorStreams streams(source.str());
+
+    int count = 0;
+    // Continuously processes new data until the connection closes
+    while (const std::array<uint8_t, PACKET_LENGTH>* packet = ring.next()) {
+
+        processPacket(streams, *packet, ring.arrival());
+        ring.release();  // Frees the packet's slot once it was processed
+
+        count += 1;
+    }
+
+    streams.close();
+    ring.stop();
+    ring.report();
+    shutdown();
+
     return 0;
 }
\ No newline at end of file
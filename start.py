@@ -83,6 +83,7 @@ if CPP_RUN:
     time0 = time()
 
     os.system(f"program.exe {DATA_PATH_CMD} {WRITE_BIN} {WRITE_SNIPPETS} {WRITE_REMEDIANS} {WRITE_PARTICLES} {ELECTRODE_LOCATIONS}")  # Runs the program with parameters
+    os.system("program.exe --convert=.")  # Converts the binary output files into .csv files
     time1 = time()
 
     print("C++ Finished in {:.2f} Seconds".format(time1 - time0))